@@ -70,7 +70,7 @@ enum REQ_STATE
 
 typedef struct mem
 {
-  int size;
+  kma_size_t size;
   void* ptr;
   void* value; // to check correctness
   enum REQ_STATE state;
@@ -83,8 +83,8 @@ static int val = 0;
 /************Function Prototypes******************************************/
 void allocate();
 void deallocate();
-void fill(char*, int);
-void check(char*, char*, int);
+void fill(char*, kma_size_t);
+void check(char*, char*, kma_size_t);
 void usage();
 void error(char*, char*);
 void pass();
@@ -98,7 +98,7 @@ void fail();
 
 int anyMismatches = 0;
 
-int currentAllocBytes = 0;
+long currentAllocBytes = 0;
 
 char *name = NULL;
 
@@ -130,7 +130,7 @@ main(int argc, char* argv[])
     {
       error("unable to open allocation output file", "kma_output.dat");
     }
-  fprintf(allocTrace, "0 0 0\n");
+  fprintf(allocTrace, "0 0 0 0\n");
 #endif
 
   if (argc != 2)
@@ -154,7 +154,8 @@ main(int argc, char* argv[])
   memset(requests, 0, (n_req + 1)*sizeof(mem_t));
   
   char command[16];
-  int req_id, req_size, index = 1;
+  int req_id, index = 1;
+  kma_size_t req_size;
 
   // Parse the lines in the file, and call allocate or
   // deallocate accordingly.
@@ -163,7 +164,7 @@ main(int argc, char* argv[])
       if (strcmp(command, "REQUEST") == 0)
 	{
 	  
-	  if (fscanf(f_test, "%d %d", &req_id, &req_size) != 2)
+	  if (fscanf(f_test, "%d %zu", &req_id, &req_size) != 2)
 	    error("Not enough arguments to REQUEST", "");
 
 	  assert(req_id >= 0 && req_id < n_req);
@@ -187,7 +188,7 @@ main(int argc, char* argv[])
 	}
 
       stat = page_stats();
-      int totalBytes = stat->num_in_use * stat->page_size;
+      long totalBytes = (long) stat->num_in_use * stat->page_size;
 
       
 #ifdef COMPETITION
@@ -195,14 +196,15 @@ main(int argc, char* argv[])
 	{
 	  // We can calculate the ratio of wasted to used memory here.
 
-	  int wastedBytes = totalBytes - currentAllocBytes;
+	  long wastedBytes = totalBytes - currentAllocBytes;
 	  ratioSum += ((double) wastedBytes) / currentAllocBytes;
 	  ratioCount += 1;
 	}
 #endif
 
 #ifndef COMPETITION
-      fprintf(allocTrace, "%d %d %d\n", index, currentAllocBytes, totalBytes);
+      fprintf(allocTrace, "%d %ld %ld %ld\n", index, currentAllocBytes, totalBytes,
+	      (long) stat->num_resident * stat->page_size);
 #endif
       
       index += 1;
@@ -217,6 +219,8 @@ main(int argc, char* argv[])
   
   printf("Page Requested/Freed/In Use: %5d/%5d/%5d\n",
 	 stat->num_requested, stat->num_freed, stat->num_in_use);	
+  printf("Page High-water/Grows/Shrinks: %5d/%5d/%5d\n",
+	 stat->max_in_use, stat->num_grows, stat->num_shrinks);
   
   if (stat->num_requested != stat->num_freed || stat->num_in_use != 0)
     {
@@ -263,7 +267,7 @@ error(char* message, char* arg ) {
 }
 
 void
-allocate(mem_t* requests, int req_id, int req_size)
+allocate(mem_t* requests, int req_id, kma_size_t req_size)
 {
   mem_t* new = &requests[req_id];
   
@@ -272,16 +276,10 @@ allocate(mem_t* requests, int req_id, int req_size)
   new->size = req_size;
   new->ptr = kma_malloc(new->size);
   
-  // Accept a NULL response in some cases... 
-  if(!(((new->ptr != NULL) && (new->size <= (PAGESIZE - sizeof(void*))))
-       || ((new->ptr == NULL) && (new->size > (PAGESIZE - sizeof(void*))))))
-    {
-      error("got NULL from kma_malloc for alloc'able request", "");
-    }
-  
+  // requests of any size are alloc'able
   if (new->ptr == NULL)
     {
-      return;
+      error("got NULL from kma_malloc for alloc'able request", "");
     }
 
   currentAllocBytes += req_size;
@@ -324,7 +322,12 @@ deallocate(mem_t* requests, int req_id)
   free(cur->value);
 #endif
 
+  // build with KMA_UNSIZED to free without the recorded size
+#ifdef KMA_UNSIZED
+  kma_free_unsized(cur->ptr);
+#else
   kma_free(cur->ptr, cur->size);
+#endif
 
   currentAllocBytes -= cur->size;
   
@@ -332,9 +335,9 @@ deallocate(mem_t* requests, int req_id)
 }
 
 void
-fill(char* ptr, int size)
+fill(char* ptr, kma_size_t size)
 {
-  int i;
+  kma_size_t i;
   
   for (i = 0; i < size; i++)
     {
@@ -343,15 +346,15 @@ fill(char* ptr, int size)
 }
 
 void
-check(char* lhs, char* rhs, int size)
+check(char* lhs, char* rhs, kma_size_t size)
 {
-  int i;
+  kma_size_t i;
   
   for (i = 0; i < size; i++)
     {
       if (lhs[i] != rhs[i])
 	{
-	  fprintf(stderr, "memory mismatch at position %d (%3d!=%3d)\n", 
+	  fprintf(stderr, "memory mismatch at position %zu (%3d!=%3d)\n", 
 		  i, lhs[i], rhs[i]);
 	  anyMismatches = 1;
 	}
@@ -0,0 +1,875 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Microbenchmarks for the kernel page and memory allocators
+ ***************************************************************************/
+#define __KMA_BENCH_IMPL__
+
+/************System include***********************************************/
+#include <assert.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#define ITERATIONS 1000000
+#define BURST 1000
+
+/* churn decommitting more pages than this per burst is giving back
+ * pages that are in use again right away */
+#define CHURN_DECOMMITS (BURST / 2)
+
+#define DEFAULT_TRACE "testsuite/5.trace"
+#define RESIDENT_SAMPLE 64
+
+#define MAXTHREADS 64
+#define DEFAULT_THREADS 8
+#define THREAD_BURST 8
+
+#define COLOR_OBJECTS 512
+#define COLOR_SIZE 1000
+#define COLOR_ROUNDS 2000
+
+#define APPEND_BUFFERS 64
+#define APPEND_STEP 16
+#define APPEND_MAX 4096
+#define APPEND_ROUNDS 20
+
+#define CALLOC_OBJECTS 256
+#define CALLOC_ROUNDS 20
+
+#define BATCH_OBJECTS 32
+#define BATCH_MAX 1024
+#define BATCH_ROUNDS 20000
+
+#define HEAP_OBJECTS 4000
+#define HEAP_MAXSIZE 2048
+#define HEAP_ROUNDS 20
+
+/* a benchmark gets the argument following its name, if any */
+typedef struct
+{
+  char* name;
+  void (*run)(char*);
+} bench_t;
+
+/************Function Prototypes******************************************/
+void bench_pages(char*);
+void bench_churn(char*);
+void bench_replay(char*);
+void bench_threads(char*);
+void bench_color(char*);
+void bench_append(char*);
+void bench_calloc(char*);
+void bench_batch(char*);
+void bench_compare(char*);
+void bench_heap(char*);
+void usage();
+void error(char*, char*);
+
+/************Global Variables*********************************************/
+
+static bench_t benches[] =
+  {
+    { "pages",   bench_pages   },
+    { "churn",   bench_churn   },
+    { "replay",  bench_replay  },
+    { "threads", bench_threads },
+    { "color",   bench_color   },
+    { "append",  bench_append  },
+    { "calloc",  bench_calloc  },
+    { "batch",   bench_batch   },
+    { "compare", bench_compare },
+    { "heap",    bench_heap    },
+    { NULL,      NULL          }
+  };
+
+static char* name = NULL;
+
+/* object sizes calloc runs through unless it is given one */
+static int calloc_sizes[] = { 16, 64, 256, 1024, 4096, 8192, 16384, 65536, 0 };
+
+/* object sizes batch runs through */
+static int batch_sizes[] = { 16, 64, 256, 1024, 4096, 0 };
+
+/* page allocator settings that replay results are labelled with */
+static char* knobs[] =
+  {
+    "KMA_HUGEPAGES",
+    "KMA_ADDRESS_ORDER",
+    "KMA_RM_FIT",
+    NULL
+  };
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+int
+main(int argc, char* argv[])
+{
+  bench_t* b;
+  int ran = 0;
+
+  name = argv[0];
+
+  for (b = benches; b->name != NULL; b++)
+    {
+      if (argc < 2 || strcmp(argv[1], b->name) == 0)
+	{
+	  b->run(argc > 2 ? argv[2] : NULL);
+	  ran = 1;
+	}
+    }
+
+  if (!ran)
+    {
+      usage();
+    }
+
+  return 0;
+}
+
+void
+usage()
+{
+  bench_t* b;
+
+  printf("Usage: %s [benchmark [argument]]\n", name);
+  printf("Benchmarks:");
+  for (b = benches; b->name != NULL; b++)
+    {
+      printf(" %s", b->name);
+    }
+  printf("\n");
+  exit(0);
+}
+
+void
+error(char* message, char* arg)
+{
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  exit(-1);
+}
+
+/* monotonic time in nanoseconds */
+double
+now()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+void
+report(char* bench, char* what, double ns, int ops)
+{
+  printf("%-8s %-28s %10.1f ns/op\n", bench, what, ns / ops);
+}
+
+/* reports a counter, n/a if it could not be read */
+void
+report_count(char* bench, char* what, long long count)
+{
+  if (count >= 0)
+    {
+      printf("%-8s %-28s %10lld\n", bench, what, count);
+    }
+  else
+    {
+      printf("%-8s %-28s %10s\n", bench, what, "n/a");
+    }
+}
+
+/* opens a counter of read misses in a cache (PERF_COUNT_HW_CACHE_*) of
+ * this process, -1 if the system does not let us */
+int
+open_miss_counter(int cache)
+{
+  struct perf_event_attr attr;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = cache
+    | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+    | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+
+  return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+long long
+read_counter(int fd)
+{
+  long long count;
+
+  if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count))
+    {
+      return -1;
+    }
+  return count;
+}
+
+/* prints the histogram of get_page() latencies, if the page allocator
+ * was built to keep one */
+void
+report_latency(char* bench)
+{
+  kma_page_stat_t stats;
+  char what[32];
+  int i;
+
+  page_snapshot(&stats);
+  for (i = 0; i < LATENCYBUCKETS; i++)
+    {
+      if (stats.latency[i] > 0)
+	{
+	  sprintf(what, "get_page() %lu+ cycles", 1UL << i);
+	  printf("%-8s %-28s %10ld\n", bench, what, stats.latency[i]);
+	}
+    }
+}
+
+/* get_page()/free_page() pairs, back to back and in bursts */
+void
+bench_pages(char* arg)
+{
+  kma_page_t* pages[BURST];
+  kma_page_t* keep;
+  double start;
+  int i, j;
+
+  // keep one page in use so the pool is not torn down in between
+  keep = get_page();
+
+  start = now();
+  for (i = 0; i < ITERATIONS; i++)
+    {
+      free_page(get_page());
+    }
+  report("pages", "get/free pair", now() - start, ITERATIONS);
+
+  start = now();
+  for (i = 0; i < ITERATIONS / BURST; i++)
+    {
+      for (j = 0; j < BURST; j++)
+	{
+	  pages[j] = get_page();
+	}
+      for (j = 0; j < BURST; j++)
+	{
+	  free_page(pages[j]);
+	}
+    }
+  report("pages", "get/free pair, burst of 1000", now() - start,
+	 (ITERATIONS / BURST) * BURST);
+
+  start = now();
+  for (i = 0; i < ITERATIONS / BURST; i++)
+    {
+      get_page_batch(BURST, pages);
+      free_page_batch(BURST, pages);
+    }
+  report("pages", "get/free pair, batch of 1000", now() - start,
+	 (ITERATIONS / BURST) * BURST);
+
+  free_page(keep);
+
+  report_latency("pages");
+}
+
+/* bursts of pages, written and freed again, that span several chunks.
+ * the pages are back in use within microseconds, so the page allocator
+ * must not give them back to the system in between. fails if it does */
+void
+bench_churn(char* arg)
+{
+  kma_page_t* pages[BURST];
+  kma_page_t* keep;
+  double start;
+  int decommitted, i, j;
+
+  keep = get_page();
+  decommitted = page_stats()->num_decommitted;
+
+  start = now();
+  for (i = 0; i < ITERATIONS / BURST; i++)
+    {
+      for (j = 0; j < BURST; j++)
+	{
+	  pages[j] = get_page();
+	  *(int*) pages[j]->ptr = j;
+	}
+      for (j = 0; j < BURST; j++)
+	{
+	  free_page(pages[j]);
+	}
+    }
+  report("churn", "written burst of 1000", now() - start,
+	 (ITERATIONS / BURST) * BURST);
+
+  decommitted = page_stats()->num_decommitted - decommitted;
+  report_count("churn", "pages decommitted", decommitted);
+  free_page(keep);
+
+  if (decommitted > (ITERATIONS / BURST) * CHURN_DECOMMITS)
+    {
+      error("pages in use again were decommitted", "churn");
+    }
+}
+
+/* replays a trace through kma_malloc()/kma_free(), writing every
+ * allocation once, and counts data TLB misses along the way. the pages
+ * resident are sampled every RESIDENT_SAMPLE operations. */
+void
+bench_replay(char* arg)
+{
+  char* trace = (arg != NULL) ? arg : DEFAULT_TRACE;
+  char command[16];
+  void** ptrs;
+  int* sizes;
+  int n_req, n_ops = 0, req_id, req_size;
+  long long misses;
+  kma_page_stat_t stats;
+  double resident = 0;
+  int samples = 0;
+  double start, elapsed;
+  int fd, i;
+  FILE* f;
+
+  f = fopen(trace, "r");
+  if (f == NULL)
+    {
+      error("unable to open input test file", trace);
+    }
+  if (fscanf(f, "%d\n", &n_req) != 1)
+    {
+      error("Couldn't read number of requests at head of file", trace);
+    }
+
+  ptrs = calloc(n_req, sizeof(void*));
+  sizes = calloc(n_req, sizeof(int));
+
+  fd = open_miss_counter(PERF_COUNT_HW_CACHE_DTLB);
+  if (fd >= 0)
+    {
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+  start = now();
+  while (fscanf(f, "%10s", command) == 1)
+    {
+      if (strcmp(command, "REQUEST") == 0
+	  && fscanf(f, "%d %d", &req_id, &req_size) == 2)
+	{
+	  ptrs[req_id] = kma_malloc(req_size);
+	  sizes[req_id] = req_size;
+	  if (ptrs[req_id] != NULL)
+	    {
+	      memset(ptrs[req_id], req_id, req_size);
+	    }
+	}
+      else if (strcmp(command, "FREE") == 0
+	       && fscanf(f, "%d", &req_id) == 1)
+	{
+	  if (ptrs[req_id] != NULL)
+	    {
+	      kma_free(ptrs[req_id], sizes[req_id]);
+	    }
+	}
+      else
+	{
+	  error("unknown command type:", command);
+	}
+      if (++n_ops % RESIDENT_SAMPLE == 0)
+	{
+	  page_snapshot(&stats);
+	  resident += stats.num_resident;
+	  samples++;
+	}
+    }
+  elapsed = now() - start;
+
+  if (fd >= 0)
+    {
+      ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+  misses = read_counter(fd);
+
+  printf("replay   %s, %s", trace, kma_backend()->name);
+  for (i = 0; knobs[i] != NULL; i++)
+    {
+      if (getenv(knobs[i]) != NULL)
+	{
+	  printf(", %s=%s", knobs[i], getenv(knobs[i]));
+	}
+    }
+  printf("\n");
+  report("replay", "kma_malloc/kma_free", elapsed, n_ops);
+  report_count("replay", "dTLB read misses", misses);
+
+  page_snapshot(&stats);
+  printf("%-8s %-28s %10.0f KB\n", "replay", "mean resident",
+	 (samples > 0) ? resident / samples * PAGESIZE / 1024 : 0.0);
+  printf("%-8s %-28s %10d KB\n", "replay", "peak mapped",
+	 stats.max_committed * PAGESIZE / 1024);
+
+  if (fd >= 0)
+    {
+      close(fd);
+    }
+  free(ptrs);
+  free(sizes);
+  fclose(f);
+}
+
+/* one thread of bench_threads: get/free pairs in small bursts, touching
+ * every page */
+void*
+thread_pages(void* arg)
+{
+  kma_page_t* pages[THREAD_BURST];
+  int i, j;
+
+  for (i = 0; i < ITERATIONS / THREAD_BURST; i++)
+    {
+      for (j = 0; j < THREAD_BURST; j++)
+	{
+	  pages[j] = get_page();
+	  *(int*) pages[j]->ptr = i;
+	}
+      for (j = 0; j < THREAD_BURST; j++)
+	{
+	  free_page(pages[j]);
+	}
+    }
+
+  return NULL;
+}
+
+/* get_page()/free_page() from 1, 2, 4, ... up to the given number of
+ * threads at once. the time per operation is taken over all threads,
+ * so it drops as the page allocator scales. */
+void
+bench_threads(char* arg)
+{
+  pthread_t threads[MAXTHREADS];
+  char what[32];
+  kma_page_t* keep;
+  kma_page_stat_t* stats;
+  double start;
+  int max = (arg != NULL) ? atoi(arg) : DEFAULT_THREADS;
+  int n, i;
+
+  if (max < 1 || max > MAXTHREADS)
+    {
+      error("number of threads out of range", arg);
+    }
+
+  keep = get_page();
+
+  for (n = 1; n <= max; n *= 2)
+    {
+      start = now();
+      for (i = 0; i < n; i++)
+	{
+	  if (pthread_create(&threads[i], NULL, thread_pages, NULL) != 0)
+	    {
+	      error("unable to create a thread", "");
+	    }
+	}
+      for (i = 0; i < n; i++)
+	{
+	  pthread_join(threads[i], NULL);
+	}
+      sprintf(what, "get/free pair, %d thread%s", n, (n > 1) ? "s" : "");
+      report("threads", what, now() - start,
+	     n * (ITERATIONS / THREAD_BURST) * THREAD_BURST);
+    }
+
+  free_page(keep);
+
+  for (i = 0; i < page_stats()->num_nodes; i++)
+    {
+      stats = page_node_stats(i);
+      printf("%-8s node %-23d %6d pages mapped, %6d resident\n", "threads", i,
+	     stats->num_committed, stats->num_resident);
+    }
+}
+
+/* chases pointers through the first words of objects of one size class,
+ * carved from consecutive pages, in random order. without cache coloring the objects of
+ * every page start at the same page offsets and compete for a few sets
+ * of the L1 cache. */
+void
+bench_color(char* arg)
+{
+  void* objs[COLOR_OBJECTS];
+  int order[COLOR_OBJECTS];
+  void** p;
+  char what[48];
+  int size = (arg != NULL) ? atoi(arg) : COLOR_SIZE;
+  long long misses;
+  double start;
+  int fd, i, j, k;
+
+  if (size < sizeof(void*) || size > PAGESIZE)
+    {
+      error("object size out of range", arg);
+    }
+
+  for (i = 0; i < COLOR_OBJECTS; i++)
+    {
+      objs[i] = kma_malloc(size);
+    }
+  // link the objects in random order, so that the prefetcher cannot
+  // hide the misses
+  for (i = 0; i < COLOR_OBJECTS; i++)
+    {
+      order[i] = i;
+    }
+  srand(1);
+  for (i = COLOR_OBJECTS - 1; i > 0; i--)
+    {
+      j = rand() % (i + 1);
+      k = order[i];
+      order[i] = order[j];
+      order[j] = k;
+    }
+  for (i = 0; i < COLOR_OBJECTS; i++)
+    {
+      *(void**) objs[order[i]] = objs[order[(i + 1) % COLOR_OBJECTS]];
+    }
+
+  fd = open_miss_counter(PERF_COUNT_HW_CACHE_L1D);
+  if (fd >= 0)
+    {
+      ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+      ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+  p = objs[order[0]];
+  start = now();
+  for (i = 0; i < COLOR_ROUNDS * COLOR_OBJECTS; i++)
+    {
+      p = *p;
+    }
+  sprintf(what, "%d objects of %d bytes", COLOR_OBJECTS, size);
+  report("color", what, now() - start, COLOR_ROUNDS * COLOR_OBJECTS);
+
+  if (fd >= 0)
+    {
+      ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    }
+  misses = read_counter(fd);
+  report_count("color", "L1d read misses", misses);
+
+  if (fd >= 0)
+    {
+      close(fd);
+    }
+  // the chase ends where it began
+  assert(p == objs[order[0]]);
+  for (i = 0; i < COLOR_OBJECTS; i++)
+    {
+      kma_free(objs[i], size);
+    }
+}
+
+/* grows APPEND_BUFFERS buffers side by side, APPEND_STEP bytes at a
+ * time, up to the given size. once through kma_realloc(), once by
+ * allocating, copying and freeing, which is what callers did before,
+ * and once through kma_realloc() only when the usable size of a buffer
+ * is used up. */
+void
+bench_append(char* arg)
+{
+  static char* modes[] = { "kma_realloc", "malloc/copy/free", "realloc when full" };
+  char* bufs[APPEND_BUFFERS];
+  kma_size_t usable[APPEND_BUFFERS];
+  char* res;
+  char what[48];
+  int max = (arg != NULL) ? atoi(arg) : APPEND_MAX;
+  int in_place = 0;
+  int grown = 0;
+  double start;
+  int mode, i, j, n, r;
+
+  if (max < APPEND_STEP)
+    {
+      error("buffer size out of range", arg);
+    }
+
+  for (mode = 0; mode < 3; mode++)
+    {
+      start = now();
+      for (r = 0; r < APPEND_ROUNDS; r++)
+	{
+	  memset(bufs, 0, sizeof(bufs));
+	  for (n = 0; n + APPEND_STEP <= max; n += APPEND_STEP)
+	    {
+	      for (i = 0; i < APPEND_BUFFERS; i++)
+		{
+		  if (mode == 1)
+		    {
+		      res = kma_malloc(n + APPEND_STEP);
+		      if (n > 0)
+			{
+			  memcpy(res, bufs[i], n);
+			  kma_free(bufs[i], n);
+			}
+		    }
+		  else if (mode == 2 && n > 0 && n + APPEND_STEP <= usable[i])
+		    {
+		      res = bufs[i];
+		    }
+		  else
+		    {
+		      res = kma_realloc(bufs[i], n, n + APPEND_STEP);
+		      if (mode == 0)
+			{
+			  in_place += (res == bufs[i]);
+			}
+		      else
+			{
+			  usable[i] = kma_usable_size(res);
+			  grown++;
+			}
+		    }
+		  bufs[i] = res;
+		  memset(bufs[i] + n, i, APPEND_STEP);
+		}
+	    }
+	  for (i = 0; i < APPEND_BUFFERS; i++)
+	    {
+	      for (j = 0; j < n; j++)
+		{
+		  if (bufs[i][j] != (char) i)
+		    {
+		      error("buffer contents lost", modes[mode]);
+		    }
+		}
+	      kma_free(bufs[i], n);
+	    }
+	}
+      sprintf(what, "%s, %d bytes", modes[mode], max);
+      report("append", what, now() - start, APPEND_ROUNDS * APPEND_BUFFERS * (max / APPEND_STEP));
+    }
+  report_count("append", "kma_realloc in place (%)",
+	       (long long) in_place * 100 / (APPEND_ROUNDS * APPEND_BUFFERS * (max / APPEND_STEP)));
+  report_count("append", "realloc when full called (%)",
+	       (long long) grown * 100 / (APPEND_ROUNDS * APPEND_BUFFERS * (max / APPEND_STEP)));
+}
+
+/* allocates CALLOC_OBJECTS zeroed objects of a size and frees them
+ * again, once through kma_calloc() and once through kma_malloc() and
+ * memset(), for every size or the one given */
+void
+bench_calloc(char* arg)
+{
+  void* objs[CALLOC_OBJECTS];
+  int one[2] = { 0, 0 };
+  int* sizes = calloc_sizes;
+  char what[48];
+  double start;
+  int clear, i, r, size;
+
+  if (arg != NULL)
+    {
+      one[0] = atoi(arg);
+      sizes = one;
+      if (one[0] <= 0)
+	{
+	  error("object size out of range", arg);
+	}
+    }
+
+  for (; *sizes != 0; sizes++)
+    {
+      size = *sizes;
+      // fault the class pages in, so neither variant pays for it
+      for (i = 0; i < CALLOC_OBJECTS; i++)
+	{
+	  objs[i] = kma_malloc(size);
+	  memset(objs[i], 0, size);
+	}
+      for (i = 0; i < CALLOC_OBJECTS; i++)
+	{
+	  kma_free(objs[i], size);
+	}
+      for (clear = 0; clear < 2; clear++)
+	{
+	  start = now();
+	  for (r = 0; r < CALLOC_ROUNDS; r++)
+	    {
+	      for (i = 0; i < CALLOC_OBJECTS; i++)
+		{
+		  if (clear)
+		    {
+		      objs[i] = kma_malloc(size);
+		      memset(objs[i], 0, size);
+		    }
+		  else
+		    {
+		      objs[i] = kma_calloc(1, size);
+		    }
+		}
+	      for (i = 0; i < CALLOC_OBJECTS; i++)
+		{
+		  kma_free(objs[i], size);
+		}
+	    }
+	  sprintf(what, "%s, %d bytes", clear ? "kma_malloc+memset" : "kma_calloc", size);
+	  report("calloc", what, now() - start, CALLOC_ROUNDS * CALLOC_OBJECTS);
+	}
+    }
+}
+
+/* n objects of a size allocated and freed by a loop over kma_malloc()
+ * and kma_free(), against kma_malloc_batch() and kma_free_batch() */
+void
+bench_batch(char* arg)
+{
+  void* objs[BATCH_MAX];
+  void* pin;
+  int* sizes;
+  char what[48];
+  double start;
+  int batch, i, n, r, size;
+
+  n = BATCH_OBJECTS;
+  if (arg != NULL)
+    {
+      n = atoi(arg);
+      if (n <= 0 || n > BATCH_MAX)
+	{
+	  error("batch size out of range", arg);
+	}
+    }
+
+  for (sizes = batch_sizes; *sizes != 0; sizes++)
+    {
+      size = *sizes;
+      // one object outlives the rounds, so the allocator is not torn
+      // down and set up again every round. the class pages are cut
+      // first, so neither variant pays for it
+      pin = kma_malloc(size);
+      kma_malloc_batch(size, n, objs);
+      kma_free_batch(size, n, objs);
+      for (batch = 0; batch < 2; batch++)
+	{
+	  start = now();
+	  for (r = 0; r < BATCH_ROUNDS; r++)
+	    {
+	      if (batch)
+		{
+		  kma_malloc_batch(size, n, objs);
+		  kma_free_batch(size, n, objs);
+		  continue;
+		}
+	      for (i = 0; i < n; i++)
+		{
+		  objs[i] = kma_malloc(size);
+		}
+	      for (i = 0; i < n; i++)
+		{
+		  kma_free(objs[i], size);
+		}
+	    }
+	  sprintf(what, "%s, %d x %d bytes", batch ? "batch" : "loop", n, size);
+	  report("batch", what, now() - start, BATCH_ROUNDS * n);
+	}
+      kma_free(pin, size);
+    }
+}
+
+/* the trace replayed once by every backend in turn, each one frees all
+ * it allocated before the next one starts */
+void
+bench_compare(char* arg)
+{
+  kma_ops_t* selected = kma_backend();
+  kma_ops_t** ops;
+
+  for (ops = kma_backends; *ops != NULL; ops++)
+    {
+      if (!kma_select((*ops)->name))
+	{
+	  error("memory still allocated, cannot switch to", (*ops)->name);
+	}
+      bench_replay(arg);
+    }
+  kma_select(selected->name);
+}
+
+/* a heap full of objects torn down by freeing every one of them, against
+ * kma_heap_destroy(). the heap uses the selected backend */
+void
+bench_heap(char* arg)
+{
+  kma_heap_t* heap;
+  void** objs;
+  int* sizes;
+  double elapsed[2] = { 0, 0 };
+  double start;
+  int destroy, i, r;
+
+  objs = malloc(HEAP_OBJECTS * sizeof(void*));
+  sizes = malloc(HEAP_OBJECTS * sizeof(int));
+  srand(1);
+  for (i = 0; i < HEAP_OBJECTS; i++)
+    {
+      sizes[i] = 1 + rand() % HEAP_MAXSIZE;
+    }
+
+  for (r = 0; r < HEAP_ROUNDS; r++)
+    {
+      for (destroy = 0; destroy < 2; destroy++)
+	{
+	  heap = kma_heap_create(NULL);
+	  for (i = 0; i < HEAP_OBJECTS; i++)
+	    {
+	      objs[i] = kma_heap_malloc(heap, sizes[i]);
+	    }
+	  start = now();
+	  if (!destroy)
+	    {
+	      for (i = 0; i < HEAP_OBJECTS; i++)
+		{
+		  kma_heap_free(heap, objs[i], sizes[i]);
+		}
+	    }
+	  kma_heap_destroy(heap);
+	  elapsed[destroy] += now() - start;
+	}
+    }
+
+  printf("heap     %s, %d objects up to %d bytes\n", kma_backend()->name,
+	 HEAP_OBJECTS, HEAP_MAXSIZE);
+  report("heap", "kma_heap_free each", elapsed[0], HEAP_ROUNDS * HEAP_OBJECTS);
+  report("heap", "kma_heap_destroy", elapsed[1], HEAP_ROUNDS * HEAP_OBJECTS);
+
+  free(objs);
+  free(sizes);
+}
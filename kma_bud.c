@@ -31,7 +31,6 @@
  *    - initial version for the kernel memory allocator project
  *
  ***************************************************************************/
-#ifdef KMA_BUD
 #define __KMA_IMPL__
 
 /* minimal free block size is 32. */
@@ -43,6 +42,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 
 /************Private include**********************************************/
@@ -58,7 +58,6 @@
 
 /************Global Variables*********************************************/
 
-static kma_page_t *page_entry = NULL;
 
 /************Function Prototypes******************************************/
 	
@@ -83,6 +82,7 @@ struct list_header {
 
 struct page_node {
   int bitmap[(PAGESIZE/MIN_BLK_SIZE)/(sizeof(int)*8)];
+  unsigned char order[(PAGESIZE/MIN_BLK_SIZE)/2];  // class of each allocated block, 4 bits per slot.
   int id;
   void* ptr;
   int size;
@@ -95,12 +95,13 @@ struct page_node {
 struct bud_controller {
   int used;
   int free;
-  void* node_list_page[15];
+  kma_page_t *node_pages;  // table of the pages of page nodes, doubles when full.
+  int num_node_pages;
   struct list_header freelist[HEADERSIZE];
   struct page_node page_list;
 };
 
-struct free_block *make_free_block(void *ptr, struct page_node *pnode) {
+static struct free_block *make_free_block(void *ptr, struct page_node *pnode) {
   struct free_block *blk;
 
   blk = (struct free_block*)ptr;
@@ -110,12 +111,12 @@ struct free_block *make_free_block(void *ptr, struct page_node *pnode) {
   return blk;
 }
 
-void *current_page_begin_addr(void *addr) {
+static void *current_page_begin_addr(void *addr) {
   return (void*)((unsigned long)addr & ~((unsigned long)(PAGESIZE-1)));
 }
 
 /* function for bit map */
-void set_bit(int A[], int k) {
+static void set_bit(int A[], int k) {
   int i = k/(sizeof(int)*8);
   int pos = k%(sizeof(int)*8);
 
@@ -126,7 +127,7 @@ void set_bit(int A[], int k) {
   A[i] = A[i] | flag;
 }
 
-void clear_bit(int A[], int k) {
+static void clear_bit(int A[], int k) {
   int i = k/(sizeof(int)*8);
   int pos = k%(sizeof(int)*8);
 
@@ -137,7 +138,7 @@ void clear_bit(int A[], int k) {
   A[i] = A[i] & flag;
 }
 
-int get_bit(int A[], int k) {
+static int get_bit(int A[], int k) {
   int i = k/(sizeof(int)*8);
   int pos = k%(sizeof(int)*8);
 
@@ -151,7 +152,22 @@ int get_bit(int A[], int k) {
     return 0;
 }
 
-void reset_bitmap(int A[]) {
+/* class of the block at slot k, kept in half a byte. */
+static void set_order(unsigned char A[], int k, int order) {
+  if(k % 2)
+    A[k/2] = (A[k/2] & 0x0f) | (order << 4);
+  else
+    A[k/2] = (A[k/2] & 0xf0) | order;
+}
+
+static int get_order(unsigned char A[], int k) {
+  if(k % 2)
+    return A[k/2] >> 4;
+  else
+    return A[k/2] & 0x0f;
+}
+
+static void reset_bitmap(int A[]) {
   int i;
 
   for(i=0; i<MAPSIZE; i++) {
@@ -160,7 +176,7 @@ void reset_bitmap(int A[]) {
 }
 
 
-void list_blk_insert(struct free_block *block, struct free_block  *l) {
+static void list_blk_insert(struct free_block *block, struct free_block  *l) {
   if(l->next == NULL) {
     l->next = block;
   }
@@ -170,41 +186,64 @@ void list_blk_insert(struct free_block *block, struct free_block  *l) {
   }
 }
 
-void node_list_append(struct page_node *newNode, struct page_node *prevNode) {
+static void node_list_append(struct page_node *newNode, struct page_node *prevNode) {
   newNode->prev = prevNode;
   newNode->next = NULL;
   prevNode->next = newNode;
   
 }
 
-void blk_remove(struct free_block *block, struct free_block *prevBlk) {
+static void blk_remove(struct free_block *block, struct free_block *prevBlk) {
   prevBlk->next = block->next;
   block->next = NULL;
 }
 
 
 /* get controller infomation */
-void *bud_info() {
+static void *bud_info(kma_heap_t *heap) {
   void *ptr;
-  ptr = (struct bud_controller*)((char*)page_entry->ptr + sizeof(struct page_header));
+  ptr = (struct bud_controller*)((char*)heap->entry->ptr + sizeof(struct page_header));
 
   return ptr;
 }
 
+/* a data page finds its page node through its tag: the number of the
+ * node page holding the node (0 for the entry page, k for entry k-1 of
+ * the node_pages table) times PAGESIZE plus the offset of the node in
+ * that page. node pages carry their number in their own tag. */
+static int node_tag(struct page_node *node) {
+  struct page_header *header;
+
+  header = (struct page_header*)current_page_begin_addr(node);
+  return header->page->tag * PAGESIZE + ((char*)node - (char*)header);
+}
+
+static struct page_node *node_of(kma_heap_t *heap, kma_page_t *page) {
+  struct bud_controller *control;
+  kma_page_t *nodePage;
+  int k;
+
+  control = bud_info(heap);
+  k = page->tag / PAGESIZE;
+  nodePage = (k == 0) ? heap->entry : ((kma_page_t**)control->node_pages->ptr)[k-1];
 
-void init_page_entry() {
+  return (struct page_node*)((char*)nodePage->ptr + page->tag % PAGESIZE);
+}
+
+
+static void init_page_entry(kma_heap_t *heap) {
   struct page_header *header;
   struct bud_controller *control;
   struct free_block *temp;
   void *page_end_addr;
   struct page_node *currNode, *prevNode;
-  page_entry = get_page();
+  heap->entry = get_page();
 
-  header = (struct page_header*)page_entry->ptr;
-  control = (struct bud_controller*)((char*)page_entry->ptr + sizeof(struct page_header));
-  page_end_addr = (void*)((char*)page_entry->ptr + PAGESIZE);
+  header = (struct page_header*)heap->entry->ptr;
+  control = (struct bud_controller*)((char*)heap->entry->ptr + sizeof(struct page_header));
+  page_end_addr = (void*)((char*)heap->entry->ptr + PAGESIZE);
 
-  header->page = page_entry;
+  header->page = heap->entry;
   control->used = 0;
   control->free = 0;
   
@@ -212,7 +251,7 @@ void init_page_entry() {
   int i=0;
   for(i=0; i<HEADERSIZE; i++) {
     control->freelist[i].size = (int)(pow((double)2,(double) (i+5)));
-    temp = (struct free_block*)((char*)page_entry->ptr + sizeof(struct page_header) 
+    temp = (struct free_block*)((char*)heap->entry->ptr + sizeof(struct page_header) 
         + sizeof(struct bud_controller) + i * (sizeof(struct free_block)));
     control->freelist[i].blk = temp;
     control->freelist[i].blk->next = NULL;
@@ -220,9 +259,8 @@ void init_page_entry() {
   }
 
 
-  for(i=0; i<15;i++) {
-    control->node_list_page[i] = NULL;
-  }
+  control->node_pages = NULL;
+  control->num_node_pages = 0;
 
   
   for(i=0; i<(PAGESIZE/MIN_BLK_SIZE)/(sizeof(int)*8); i++) {
@@ -252,14 +290,13 @@ void init_page_entry() {
 /***
  * set a new node page when every node in page_list is used.
  **/
-void set_new_node_page() {
+static void set_new_node_page(kma_heap_t *heap, kma_page_t *page) {
   struct bud_controller *control;
   struct page_node *currNode, *prevNode, *page_end_addr;
   struct page_header *header;
-  kma_page_t *page;
+  kma_page_t *table;
 
-  control = bud_info();
-  page = get_page();
+  control = bud_info(heap);
 
   header = (struct page_header*) page->ptr;
   header->page = page;
@@ -276,13 +313,18 @@ void set_new_node_page() {
   }
   prevNode->next = NULL;
 
-  int i = 0;
-  for(i=0;i<15;i++) {
-    if(control->node_list_page[i] == NULL) {
-      control->node_list_page[i] = (void*)page;
-      break;
+  /* the table doubles when it is full. */
+  if(control->node_pages == NULL
+     || (control->num_node_pages + 1) * sizeof(kma_page_t*) > control->node_pages->size) {
+    table = get_pages(control->node_pages == NULL ? 1 : 2 * NUMPAGES(control->node_pages->size));
+    if(control->node_pages != NULL) {
+      memcpy(table->ptr, control->node_pages->ptr, control->num_node_pages * sizeof(kma_page_t*));
+      free_pages(control->node_pages);
     }
+    control->node_pages = table;
   }
+  ((kma_page_t**)control->node_pages->ptr)[control->num_node_pages++] = page;
+  page->tag = control->num_node_pages;
 }
 
 /**
@@ -290,23 +332,28 @@ void set_new_node_page() {
  * call this function to allocate a new page in the 
  * page node. and use it to fit the request memory.
  **/
-void new_free_page() {
+static void new_free_page(kma_heap_t *heap) {
   struct bud_controller *control;
   struct page_node *currNode, *prevNode;
   struct free_block *blk;
-  kma_page_t *page;
+  kma_page_t *page, *pages[2];
 
-  control = bud_info();
-  
-  page = get_page();
+  control = bud_info(heap);
 
   prevNode = control->page_list.prev;
 
+  /* out of page nodes as well: take both pages in one go. */
   if(prevNode->next == NULL) {
-    set_new_node_page();
+    get_page_batch(2, pages);
+    page = pages[0];
+    set_new_node_page(heap, pages[1]);
+  }
+  else {
+    page = get_page();
   }
   currNode = prevNode->next;
   currNode->addr = page;
+  page->tag = node_tag(currNode);
   currNode->ptr = page->ptr;
   currNode->size = page->size;
   currNode->id = page->id;
@@ -321,52 +368,69 @@ void new_free_page() {
 
 
 /**
- * reduce free block size to fit request memory size.
- * Add extra space to free list array.
+ * halve a free block until it just fits request memory size.
+ * Add extra space to free list array. returns the size left.
  **/
-void resize_block(kma_size_t reqSize, void *ptr, int blkSize) {
+static int split_block(kma_heap_t *heap, kma_size_t reqSize, void *ptr, int blkSize) {
   struct bud_controller *control;
   struct free_block *temp, *curr;
   void *temp_ptr;
-  int offset;
   int i=0;
 
-  control = bud_info();
+  control = bud_info(heap);
 
   curr = (struct free_block*)ptr;
 
-  offset = ((char*)ptr - (char*)curr->node->ptr)/MIN_BLK_SIZE;
-
-  
-    while(blkSize/reqSize >= 2 && blkSize > 32) {
-      blkSize = blkSize/2;
-      temp_ptr = (void*)((char*)ptr + blkSize);
-      for(i=HEADERSIZE - 1; i > -1; i--) {
-        if(control->freelist[i].size == blkSize) {
-          temp = make_free_block(temp_ptr, curr->node);
-          list_blk_insert(temp, control->freelist[i].blk);
-          break;
-        }
+  while(blkSize/reqSize >= 2 && blkSize > 32) {
+    blkSize = blkSize/2;
+    temp_ptr = (void*)((char*)ptr + blkSize);
+    for(i=HEADERSIZE - 1; i > -1; i--) {
+      if(control->freelist[i].size == blkSize) {
+        temp = make_free_block(temp_ptr, curr->node);
+        list_blk_insert(temp, control->freelist[i].blk);
+        break;
       }
-    
+    }
   }
 
+  return blkSize;
+}
+
+/**
+ * reduce free block size to fit request memory size.
+ * Add extra space to free list array.
+ **/
+static void resize_block(kma_heap_t *heap, kma_size_t reqSize, void *ptr, int blkSize) {
+  struct free_block *curr;
+  int offset;
+  int order;
+  int i=0;
+
+  curr = (struct free_block*)ptr;
+
+  offset = ((char*)ptr - (char*)curr->node->ptr)/MIN_BLK_SIZE;
+
+  blkSize = split_block(heap, reqSize, ptr, blkSize);
+
+  for(order=0; (MIN_BLK_SIZE << order) < blkSize; order++)
+    ;
+  set_order(curr->node->order, offset, order);
+
   for(i=0; i<blkSize/MIN_BLK_SIZE; i++) {
     set_bit(curr->node->bitmap, i+offset);
   }
 }
 
-
-void *allocate_mem(kma_size_t size) {
-//  struct page_node *currNode;
+/**
+ * take the smallest free block that holds size off its free list,
+ * or a fresh page when there is none.
+ **/
+static void *take_block(kma_heap_t *heap, kma_size_t size, int *blkSize) {
   struct bud_controller *control;
   void *ptr;
-//  kma_page_t *page;
   int i=0;
 
-  control = bud_info();
-
-  control->used++;
+  control = bud_info(heap);
 
   for(i=0; i<HEADERSIZE; i++) {
     if(size <= control->freelist[i].size) {
@@ -376,19 +440,34 @@ void *allocate_mem(kma_size_t size) {
       else {
         ptr = (void*)control->freelist[i].blk->next;
         control->freelist[i].blk->next = control->freelist[i].blk->next->next;
-        resize_block(size, ptr, control->freelist[i].size);
+        *blkSize = control->freelist[i].size;
         return ptr;
       }
     }
   }
-  new_free_page();
-  ptr = control->page_list.prev->ptr;
-  resize_block(size, ptr, (int)PAGESIZE);
+  new_free_page(heap);
+  *blkSize = PAGESIZE;
+
+  return control->page_list.prev->ptr;
+}
+
+
+static void *allocate_mem(kma_heap_t *heap, kma_size_t size) {
+  struct bud_controller *control;
+  void *ptr;
+  int blkSize;
+
+  control = bud_info(heap);
+
+  control->used++;
+
+  ptr = take_block(heap, size, &blkSize);
+  resize_block(heap, size, ptr, blkSize);
 
   return ptr;
 }
 
-void coalescing(void *ptr, int blkSize, struct page_node *currNode) {
+static void coalescing(kma_heap_t *heap, void *ptr, int blkSize, struct page_node *currNode) {
   struct bud_controller *control;
   struct free_block *blk, *prevBlk;
 
@@ -402,7 +481,7 @@ void coalescing(void *ptr, int blkSize, struct page_node *currNode) {
   int found = 0;
 
 
-  control = bud_info();
+  control = bud_info(heap);
   
   offset = ((char*)ptr - (char*)currNode->ptr)/MIN_BLK_SIZE;
   blkOffset = blkSize / MIN_BLK_SIZE;
@@ -447,7 +526,7 @@ void coalescing(void *ptr, int blkSize, struct page_node *currNode) {
       }
 
       blkSize = 2 * blkSize;
-      return coalescing(ptr, blkSize, currNode);
+      return coalescing(heap, ptr, blkSize, currNode);
         
     }
     else if(free == 0) {
@@ -479,7 +558,7 @@ void coalescing(void *ptr, int blkSize, struct page_node *currNode) {
         printf("error, coalescing is error\n");
       }
       blkSize = 2 * blkSize;
-      return coalescing(prime_ptr, blkSize, currNode);
+      return coalescing(heap, prime_ptr, blkSize, currNode);
 
     }
     else if(free == 0) {
@@ -496,74 +575,378 @@ void coalescing(void *ptr, int blkSize, struct page_node *currNode) {
 
   
 
-void*
-kma_malloc(kma_size_t size)
+static void*
+bud_malloc(kma_heap_t *heap, kma_size_t size)
 {
-  if(size > PAGESIZE)
-    return NULL;
-  if(page_entry == NULL)
-    init_page_entry();
+  kma_page_t *page;
+
+  /* requests larger than a page get contiguous pages of their own */
+  if(size > PAGESIZE) {
+    page = heap_get_pages(heap, size);
+    return (page == NULL) ? NULL : page->ptr;
+  }
+  if(heap->entry == NULL)
+    init_page_entry(heap);
 
-  return allocate_mem(size);
+  /* blocks are split by how often the request fits into them. */
+  if(size < MIN_BLK_SIZE)
+    size = MIN_BLK_SIZE;
+
+  return allocate_mem(heap, size);
 }
 
-void 
-kma_free(void* ptr, kma_size_t size)
-{
+/* clear the bits of a block of class i and merge it with its buddies. */
+static void merge_block(kma_heap_t *heap, void *ptr, int i, struct page_node *currNode) {
   struct bud_controller *control;
   struct free_block *curr;
-  struct page_node *currNode ;
-  void *page_begin_addr;
   int offset;
-//  kma_page_t *tempPage;
-  int i=0;
   int j=0;
 
-  control = bud_info();
+  control = bud_info(heap);
 
-  for(i=0; i<HEADERSIZE; i++) {
-    if(size <= control->freelist[i].size) {
-      curr = ptr;
-      curr->next = NULL;
-      page_begin_addr = current_page_begin_addr(ptr);
-      currNode = control->page_list.next;
-      while(currNode->ptr != page_begin_addr){
-        currNode = currNode->next;
-      }
-      curr->node = currNode;
-      offset = ((char*)ptr - (char*)currNode->ptr) / MIN_BLK_SIZE;
-      for(j=0; j< control->freelist[i].size/MIN_BLK_SIZE; j++) {
-        clear_bit(currNode->bitmap, j+offset);
-      }
-      coalescing(ptr, control->freelist[i].size, currNode);
+  curr = ptr;
+  curr->next = NULL;
+  curr->node = currNode;
+  offset = ((char*)ptr - (char*)currNode->ptr) / MIN_BLK_SIZE;
+  for(j=0; j< control->freelist[i].size/MIN_BLK_SIZE; j++) {
+    clear_bit(currNode->bitmap, j+offset);
+  }
+  coalescing(heap, ptr, control->freelist[i].size, currNode);
+}
+
+/* hand every page back once all blocks are free again. */
+static void release_pages(kma_heap_t *heap) {
+  struct bud_controller *control;
+  struct page_node *currNode;
+  kma_page_t *batch[PAGEBATCH];
+  int n = 0;
+  int i=0;
+
+  control = bud_info(heap);
+  if(control->free != control->used)
+    return;
+
+  currNode = control->page_list.next;
+
+  while(1) {
+    batch[n++] = currNode->addr;
+    if(n == PAGEBATCH) {
+      free_page_batch(n, batch);
+      n = 0;
+    }
+    if(currNode == control->page_list.prev)
       break;
+    currNode = currNode->next;
+  }
+  free_page_batch(n, batch);
+  n = 0;
+
+  /* the page nodes and the controller go last, the walk above reads them. */
+  for(i=0; i<control->num_node_pages; i++) {
+    batch[n++] = ((kma_page_t**)control->node_pages->ptr)[i];
+    if(n == PAGEBATCH) {
+      free_page_batch(n, batch);
+      n = 0;
     }
   }
+  if(control->node_pages != NULL)
+    free_pages(control->node_pages);
+  batch[n++] = heap->entry;
+  free_page_batch(n, batch);
+  heap->entry = NULL;
+}
 
+/* free a block of class i. */
+static void release_block(kma_heap_t *heap, void *ptr, int i, struct page_node *currNode) {
+  struct bud_controller *control;
+
+  control = bud_info(heap);
+
+  merge_block(heap, ptr, i, currNode);
   control->free++;
+  release_pages(heap);
+}
 
-  if(control->free == control->used) {
-    currNode = control->page_list.next;
-    
-    while(currNode != control->page_list.prev) {
-      free_page(currNode->addr);
-      currNode = currNode->next;
-    }
-    free_page(currNode->addr);
+static void 
+bud_free(kma_heap_t *heap, void* ptr, kma_size_t size)
+{
+  struct bud_controller *control;
+  int i=0;
 
-    for(i=0; i<15; i++) {
-      if(control->node_list_page[i] != NULL) {
-        free_page(control->node_list_page[i]);
-      }
+  if(size > PAGESIZE) {
+    heap_free_pages(heap, page_of(ptr));
+    return;
+  }
+
+  control = bud_info(heap);
+
+  for(i=0; i<HEADERSIZE - 1; i++) {
+    if(size <= control->freelist[i].size)
+      break;
+  }
+  release_block(heap, ptr, i, node_of(heap, page_of(ptr)));
+}
+
+static void
+bud_free_unsized(kma_heap_t *heap, void* ptr)
+{
+  struct page_node *currNode;
+  kma_page_t *page;
+
+  /* runs of pages have no page node. */
+  page = page_of(ptr);
+  if(page->tag < 0) {
+    heap_free_pages(heap, page);
+    return;
+  }
+
+  currNode = node_of(heap, page);
+  release_block(heap, ptr, get_order(currNode->order, ((char*)ptr - (char*)currNode->ptr) / MIN_BLK_SIZE),
+                currNode);
+}
+
+static kma_size_t
+bud_usable_size(kma_heap_t *heap, void* ptr)
+{
+  struct page_node *currNode;
+  kma_page_t *page;
+
+  /* runs of pages have no page node. */
+  page = page_of(ptr);
+  if(page->tag < 0)
+    return page->size;
+
+  currNode = node_of(heap, page);
+  return MIN_BLK_SIZE << get_order(currNode->order, ((char*)ptr - (char*)currNode->ptr) / MIN_BLK_SIZE);
+}
+
+static kma_size_t
+bud_good_size(kma_heap_t *heap, kma_size_t size)
+{
+  kma_size_t blkSize;
+
+  if(size > PAGESIZE)
+    return NUMPAGES(size) * PAGESIZE;
+
+  for(blkSize = MIN_BLK_SIZE; blkSize < size; blkSize *= 2)
+    ;
+  return blkSize;
+}
+
+/* cut count blocks of class k out of a single free block split just
+ * big enough for them, and hand the blocks past the last one back as
+ * the largest buddies that fit. */
+static void carve_blocks(kma_heap_t *heap, int k, int count, void *ptrs[]) {
+  struct bud_controller *control;
+  struct page_node *currNode;
+  struct free_block *blk;
+  void *ptr;
+  int span, blkSize, offset, unit;
+  int p=0, q=0, j=0;
+
+  control = bud_info(heap);
+
+  for(span=1; span<count; span*=2)
+    ;
+  ptr = take_block(heap, span * control->freelist[k].size, &blkSize);
+  split_block(heap, span * control->freelist[k].size, ptr, blkSize);
+
+  currNode = ((struct free_block*)ptr)->node;
+  offset = ((char*)ptr - (char*)currNode->ptr) / MIN_BLK_SIZE;
+  unit = control->freelist[k].size / MIN_BLK_SIZE;
+
+  for(j=0; j<count; j++) {
+    ptrs[j] = (char*)ptr + j * control->freelist[k].size;
+    set_order(currNode->order, offset + j * unit, k);
+  }
+  for(j=0; j<count * unit; j++) {
+    set_bit(currNode->bitmap, offset + j);
+  }
+
+  for(p=count; p<span; p+=1<<q) {
+    for(q=0; p % (2<<q) == 0 && p + (2<<q) <= span; q++)
+      ;
+    blk = make_free_block((char*)ptr + p * control->freelist[k].size, currNode);
+    list_blk_insert(blk, control->freelist[k+q].blk);
+  }
+}
+
+static void
+bud_malloc_batch(kma_heap_t *heap, kma_size_t size, int n, void* ptrs[])
+{
+  struct bud_controller *control;
+  int count;
+  int i=0, j=0;
+
+  if(size > PAGESIZE) {
+    for(j=0; j<n; j++)
+      ptrs[j] = bud_malloc(heap, size);
+    return;
+  }
+  if(heap->entry == NULL)
+    init_page_entry(heap);
+
+  control = bud_info(heap);
+  for(i=0; i<HEADERSIZE - 1 && size > control->freelist[i].size; i++)
+    ;
+  control->used += n;
+
+  /* a page holds at most PAGESIZE / size blocks of the class. */
+  for(j=0; j<n; j+=count) {
+    count = n - j;
+    if(count > PAGESIZE / control->freelist[i].size)
+      count = PAGESIZE / control->freelist[i].size;
+    carve_blocks(heap, i, count, ptrs + j);
+  }
+}
+
+static void
+bud_free_batch(kma_heap_t *heap, kma_size_t size, int n, void* ptrs[])
+{
+  struct bud_controller *control;
+  struct page_node *currNode = NULL;
+  int i=0, j=0;
+
+  if(size > PAGESIZE) {
+    for(j=0; j<n; j++)
+      heap_free_pages(heap, page_of(ptrs[j]));
+    return;
+  }
+
+  control = bud_info(heap);
+  for(i=0; i<HEADERSIZE - 1 && size > control->freelist[i].size; i++)
+    ;
+
+  /* blocks of a batch mostly share their page, and so their node. */
+  for(j=0; j<n; j++) {
+    if(j == 0 || BASEADDR(ptrs[j]) != BASEADDR(ptrs[j-1]))
+      currNode = node_of(heap, page_of(ptrs[j]));
+    merge_block(heap, ptrs[j], i, currNode);
+  }
+  control->free += n;
+  release_pages(heap);
+}
+
+static void*
+bud_memalign(kma_heap_t *heap, kma_size_t alignment, kma_size_t size)
+{
+  if(alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment > PAGESIZE)
+    return NULL;
+
+  /* a buddy is aligned to its size, as the page it is split from is,
+   * and runs start a page. */
+  if(size < alignment)
+    size = alignment;
+  return bud_malloc(heap, size);
+}
+
+/* grow a block of class i at ptr to class k in place by absorbing the
+ * buddies that follow it, or shrink it by handing its upper halves
+ * back. returns 0, leaving the block as it is, when a buddy on the way
+ * up is not free as a whole. */
+static int resize_in_place(kma_heap_t *heap, void *ptr, int i, int k, struct page_node *currNode) {
+  struct bud_controller *control;
+  struct free_block *blk, *prevBlk[HEADERSIZE];
+  int offset;
+  int c=0;
+  int j=0;
+
+  control = bud_info(heap);
+  offset = ((char*)ptr - (char*)currNode->ptr) / MIN_BLK_SIZE;
+
+  for(c=i; c<k; c++) {
+    if(offset % (2 * control->freelist[c].size / MIN_BLK_SIZE) != 0)
+      return 0;
+    prevBlk[c] = control->freelist[c].blk;
+    blk = prevBlk[c]->next;
+    while(blk != NULL && (char*)blk != (char*)ptr + control->freelist[c].size) {
+      prevBlk[c] = blk;
+      blk = blk->next;
     }
-    free_page(page_entry);
-    page_entry = NULL;
+    if(blk == NULL)
+      return 0;
   }
 
+  for(c=i; c<k; c++) {
+    blk_remove(prevBlk[c]->next, prevBlk[c]);
+  }
+  for(c=i-1; c>=k; c--) {
+    blk = make_free_block((char*)ptr + control->freelist[c].size, currNode);
+    list_blk_insert(blk, control->freelist[c].blk);
+  }
 
+  for(j=0; j<control->freelist[k > i ? k : i].size/MIN_BLK_SIZE; j++) {
+    if(j < control->freelist[k].size/MIN_BLK_SIZE)
+      set_bit(currNode->bitmap, j+offset);
+    else
+      clear_bit(currNode->bitmap, j+offset);
+  }
+  set_order(currNode->order, offset, k);
 
-  
-  
+  return 1;
+}
+
+static void*
+bud_realloc(kma_heap_t *heap, void* ptr, kma_size_t old, kma_size_t size)
+{
+  struct bud_controller *control;
+  void *res;
+  int i=0, k=0;
+
+  if(ptr == NULL)
+    return bud_malloc(heap, size);
+  if(size == 0) {
+    bud_free(heap, ptr, old);
+    return NULL;
+  }
+
+  if(old > PAGESIZE) {
+    if(size > PAGESIZE && size <= page_of(ptr)->size)
+      return ptr;
+  }
+  else if(size <= PAGESIZE) {
+    control = bud_info(heap);
+    for(i=0; i<HEADERSIZE - 1 && old > control->freelist[i].size; i++)
+      ;
+    for(k=0; k<HEADERSIZE - 1 && size > control->freelist[k].size; k++)
+      ;
+    if(i == k || resize_in_place(heap, ptr, i, k, node_of(heap, page_of(ptr))))
+      return ptr;
+  }
+
+  res = bud_malloc(heap, size);
+  if(res != NULL) {
+    memcpy(res, ptr, old < size ? old : size);
+    bud_free(heap, ptr, old);
+  }
+  return res;
+}
+
+static void
+bud_destroy(kma_heap_t *heap)
+{
+  struct bud_controller *control;
+
+  heap_free_runs(heap);
+  if(heap->entry == NULL)
+    return;
+
+  control = bud_info(heap);
+  control->free = control->used;
+  release_pages(heap);
 }
 
-#endif // KMA_BUD
+kma_ops_t kma_bud_ops =
+  {
+    .name         = "bud",
+    .malloc       = bud_malloc,
+    .free         = bud_free,
+    .free_unsized = bud_free_unsized,
+    .realloc      = bud_realloc,
+    .memalign     = bud_memalign,
+    .usable_size  = bud_usable_size,
+    .good_size    = bud_good_size,
+    .malloc_batch = bud_malloc_batch,
+    .free_batch   = bud_free_batch,
+    .destroy      = bud_destroy
+  };
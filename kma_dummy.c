@@ -40,12 +40,12 @@
  *    - initial version for the kernel memory allocator project
  *
  ***************************************************************************/
-#ifdef KMA_DUMMY
 #define __KMA_IMPL__
 
 /************System include***********************************************/
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -66,22 +66,20 @@
 
 /**************Implementation***********************************************/
 
-void* kma_malloc(kma_size_t size)
+static void* dummy_malloc(kma_heap_t *heap, kma_size_t size)
 {
   kma_page_t* page;
   
-  // get one page
-  page = get_page();
+  // get enough pages for the request and the page structure pointer
+  if (__builtin_add_overflow(size, sizeof(kma_page_t*), &size)
+      || (page = heap_get_pages(heap, size)) == NULL)
+    {
+      return NULL;
+    }
   
   // add a pointer to the page structure at the beginning of the page
   *((kma_page_t**)page->ptr) = page;
   
-  if ((size + sizeof(kma_page_t*)) > page->size)
-    { // requested size too large
-      free_page(page);
-      return NULL;
-    }
-  
   // check whether the BASEADDR macro works
   //for (i = 0; i < page->size; i++)
   //{
@@ -92,13 +90,129 @@ void* kma_malloc(kma_size_t size)
   return page->ptr + sizeof(kma_page_t*);
 }
 
-void kma_free(void* ptr, kma_size_t size)
+static void dummy_free(kma_heap_t *heap, void* ptr, kma_size_t size)
+{
+  kma_page_t* page;
+  
+  page = *((kma_page_t**)(ptr - sizeof(kma_page_t*)));
+  
+  heap_free_pages(heap, page);
+}
+
+static void dummy_free_unsized(kma_heap_t *heap, void* ptr)
+{
+  dummy_free(heap, ptr, 0);
+}
+
+static kma_size_t dummy_usable_size(kma_heap_t *heap, void* ptr)
+{
+  kma_page_t* page;
+  
+  page = *((kma_page_t**)(ptr - sizeof(kma_page_t*)));
+  
+  return page->ptr + page->size - ptr;
+}
+
+static kma_size_t dummy_good_size(kma_heap_t *heap, kma_size_t size)
+{
+  return NUMPAGES(size + sizeof(kma_page_t*)) * PAGESIZE - sizeof(kma_page_t*);
+}
+
+static void dummy_malloc_batch(kma_heap_t *heap, kma_size_t size, int n, void* ptrs[])
+{
+  int i;
+  
+  for (i = 0; i < n; i++)
+    {
+      ptrs[i] = dummy_malloc(heap, size);
+    }
+}
+
+static void dummy_free_batch(kma_heap_t *heap, kma_size_t size, int n, void* ptrs[])
+{
+  int i;
+  
+  for (i = 0; i < n; i++)
+    {
+      dummy_free(heap, ptrs[i], size);
+    }
+}
+
+static void* dummy_memalign(kma_heap_t *heap, kma_size_t alignment, kma_size_t size)
+{
+  kma_page_t* page;
+  void* ptr;
+  
+  if (alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment > PAGESIZE)
+    {
+      return NULL;
+    }
+  if (alignment < sizeof(kma_page_t*))
+    {
+      alignment = sizeof(kma_page_t*);
+    }
+  
+  // the page pointer goes right in front of the memory, as always
+  if (__builtin_add_overflow(size, alignment, &size)
+      || (page = heap_get_pages(heap, size)) == NULL)
+    {
+      return NULL;
+    }
+  ptr = page->ptr + alignment;
+  *((kma_page_t**)(ptr - sizeof(kma_page_t*))) = page;
+  
+  return ptr;
+}
+
+static void* dummy_realloc(kma_heap_t *heap, void* ptr, kma_size_t old, kma_size_t size)
 {
   kma_page_t* page;
+  void* res;
+  
+  if (ptr == NULL)
+    {
+      return dummy_malloc(heap, size);
+    }
+  if (size == 0)
+    {
+      dummy_free(heap, ptr, old);
+      return NULL;
+    }
   
+  // stay in the pages we have as long as the request fits
   page = *((kma_page_t**)(ptr - sizeof(kma_page_t*)));
+  if (size <= (char*)page->ptr + page->size - (char*)ptr)
+    {
+      return ptr;
+    }
   
-  free_page(page);
+  res = dummy_malloc(heap, size);
+  if (res != NULL)
+    {
+      memcpy(res, ptr, old < size ? old : size);
+      dummy_free(heap, ptr, old);
+    }
+  return res;
+}
+
+/* every block is a run of pages of its own */
+static void
+dummy_destroy(kma_heap_t* heap)
+{
+  heap_free_runs(heap);
 }
 
-#endif // KMA_DUMMY
+kma_ops_t kma_dummy_ops =
+  {
+    .name         = "dummy",
+    .malloc       = dummy_malloc,
+    .free         = dummy_free,
+    .free_unsized = dummy_free_unsized,
+    .realloc      = dummy_realloc,
+    .memalign     = dummy_memalign,
+    .usable_size  = dummy_usable_size,
+    .good_size    = dummy_good_size,
+    .malloc_batch = dummy_malloc_batch,
+    .free_batch   = dummy_free_batch,
+    .destroy      = dummy_destroy
+  };
@@ -32,7 +32,6 @@
  *    - initial version for the kernel memory allocator project
  *
  ***************************************************************************/
-#ifdef KMA_LZBUD
 #define __KMA_IMPL__
 
 
@@ -45,6 +44,7 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <math.h>
 
 /************Private include**********************************************/
@@ -60,7 +60,6 @@
 
 /************Global Variables*********************************************/
 
-static kma_page_t *page_entry = NULL;
 
 /************Function Prototypes******************************************/
 	
@@ -86,6 +85,7 @@ struct list_header {
 
 struct page_node {
   int bitmap[(PAGESIZE/MIN_BLK_SIZE)/(sizeof(int)*8)];
+  unsigned char order[(PAGESIZE/MIN_BLK_SIZE)/2];  // class of each allocated block, 4 bits per slot.
   int id;
   void* ptr;
   int size;
@@ -98,12 +98,13 @@ struct page_node {
 struct bud_controller {
   int used;
   int free;
-  void* node_list_page[15];
+  kma_page_t *node_pages;  // table of the pages of page nodes, doubles when full.
+  int num_node_pages;
   struct list_header freelist[HEADERSIZE];
   struct page_node page_list;
 };
 
-struct free_block *make_free_block(void *ptr, struct page_node *pnode) {
+static struct free_block *make_free_block(void *ptr, struct page_node *pnode) {
   struct free_block *blk;
 
   blk = (struct free_block*)ptr;
@@ -113,12 +114,12 @@ struct free_block *make_free_block(void *ptr, struct page_node *pnode) {
   return blk;
 }
 
-void *current_page_begin_addr(void *addr) {
+static void *current_page_begin_addr(void *addr) {
   return (void*)((unsigned long)addr & ~((unsigned long)(PAGESIZE-1)));
 }
 
 /* function for bit map */
-void set_bit(int A[], int k) {
+static void set_bit(int A[], int k) {
   int i = k/(sizeof(int)*8);
   int pos = k%(sizeof(int)*8);
 
@@ -129,7 +130,7 @@ void set_bit(int A[], int k) {
   A[i] = A[i] | flag;
 }
 
-void clear_bit(int A[], int k) {
+static void clear_bit(int A[], int k) {
   int i = k/(sizeof(int)*8);
   int pos = k%(sizeof(int)*8);
 
@@ -140,7 +141,7 @@ void clear_bit(int A[], int k) {
   A[i] = A[i] & flag;
 }
 
-int get_bit(int A[], int k) {
+static int get_bit(int A[], int k) {
   int i = k/(sizeof(int)*8);
   int pos = k%(sizeof(int)*8);
 
@@ -154,7 +155,22 @@ int get_bit(int A[], int k) {
     return 0;
 }
 
-void reset_bitmap(int A[]) {
+/* class of the block at slot k, kept in half a byte. */
+static void set_order(unsigned char A[], int k, int order) {
+  if(k % 2)
+    A[k/2] = (A[k/2] & 0x0f) | (order << 4);
+  else
+    A[k/2] = (A[k/2] & 0xf0) | order;
+}
+
+static int get_order(unsigned char A[], int k) {
+  if(k % 2)
+    return A[k/2] >> 4;
+  else
+    return A[k/2] & 0x0f;
+}
+
+static void reset_bitmap(int A[]) {
   int i;
 
   for(i=0; i<MAPSIZE; i++) {
@@ -162,7 +178,7 @@ void reset_bitmap(int A[]) {
   }
 }
 
-int get_blk_bit(struct free_block *blk) {
+static int get_blk_bit(struct free_block *blk) {
   int k;
 
   k = ((char*)blk - (char*)(current_page_begin_addr((void*)blk))) / MIN_BLK_SIZE;
@@ -173,7 +189,7 @@ int get_blk_bit(struct free_block *blk) {
 
 
 
-void list_blk_insert(struct free_block *block, struct free_block  *l) {
+static void list_blk_insert(struct free_block *block, struct free_block  *l) {
   if(l->next == NULL) {
     l->next = block;
   }
@@ -183,41 +199,64 @@ void list_blk_insert(struct free_block *block, struct free_block  *l) {
   }
 }
 
-void node_list_append(struct page_node *newNode, struct page_node *prevNode) {
+static void node_list_append(struct page_node *newNode, struct page_node *prevNode) {
   newNode->prev = prevNode;
   newNode->next = NULL;
   prevNode->next = newNode;
   
 }
 
-void blk_remove(struct free_block *block, struct free_block *prevBlk) {
+static void blk_remove(struct free_block *block, struct free_block *prevBlk) {
   prevBlk->next = block->next;
   block->next = NULL;
 }
 
 
 /* get controller infomation */
-void *bud_info() {
+static void *bud_info(kma_heap_t *heap) {
   void *ptr;
-  ptr = (struct bud_controller*)((char*)page_entry->ptr + sizeof(struct page_header));
+  ptr = (struct bud_controller*)((char*)heap->entry->ptr + sizeof(struct page_header));
 
   return ptr;
 }
 
+/* a data page finds its page node through its tag: the number of the
+ * node page holding the node (0 for the entry page, k for entry k-1 of
+ * the node_pages table) times PAGESIZE plus the offset of the node in
+ * that page. node pages carry their number in their own tag. */
+static int node_tag(struct page_node *node) {
+  struct page_header *header;
+
+  header = (struct page_header*)current_page_begin_addr(node);
+  return header->page->tag * PAGESIZE + ((char*)node - (char*)header);
+}
+
+static struct page_node *node_of(kma_heap_t *heap, kma_page_t *page) {
+  struct bud_controller *control;
+  kma_page_t *nodePage;
+  int k;
 
-void init_page_entry() {
+  control = bud_info(heap);
+  k = page->tag / PAGESIZE;
+  nodePage = (k == 0) ? heap->entry : ((kma_page_t**)control->node_pages->ptr)[k-1];
+
+  return (struct page_node*)((char*)nodePage->ptr + page->tag % PAGESIZE);
+}
+
+
+static void init_page_entry(kma_heap_t *heap) {
   struct page_header *header;
   struct bud_controller *control;
   struct free_block *temp;
   void *page_end_addr;
   struct page_node *currNode, *prevNode;
-  page_entry = get_page();
+  heap->entry = get_page();
 
-  header = (struct page_header*)page_entry->ptr;
-  control = (struct bud_controller*)((char*)page_entry->ptr + sizeof(struct page_header));
-  page_end_addr = (void*)((char*)page_entry->ptr + PAGESIZE);
+  header = (struct page_header*)heap->entry->ptr;
+  control = (struct bud_controller*)((char*)heap->entry->ptr + sizeof(struct page_header));
+  page_end_addr = (void*)((char*)heap->entry->ptr + PAGESIZE);
 
-  header->page = page_entry;
+  header->page = heap->entry;
   control->used = 0;
   control->free = 0;
   
@@ -226,7 +265,7 @@ void init_page_entry() {
   for(i=0; i<HEADERSIZE; i++) {
     control->freelist[i].size = (int)(pow((double)2,(double) (i+5)));
     control->freelist[i].weight = 0;
-    temp = (struct free_block*)((char*)page_entry->ptr + sizeof(struct page_header) 
+    temp = (struct free_block*)((char*)heap->entry->ptr + sizeof(struct page_header) 
         + sizeof(struct bud_controller) + i * (sizeof(struct free_block)));
     control->freelist[i].blk = temp;
     control->freelist[i].blk->next = NULL;
@@ -234,9 +273,8 @@ void init_page_entry() {
   }
 
 
-  for(i=0; i<15;i++) {
-    control->node_list_page[i] = NULL;
-  }
+  control->node_pages = NULL;
+  control->num_node_pages = 0;
 
   
   for(i=0; i<(PAGESIZE/MIN_BLK_SIZE)/(sizeof(int)*8); i++) {
@@ -266,14 +304,13 @@ void init_page_entry() {
 /***
  * set a new node page when every node in page_list is used.
  **/
-void set_new_node_page() {
+static void set_new_node_page(kma_heap_t *heap, kma_page_t *page) {
   struct bud_controller *control;
   struct page_node *currNode, *prevNode, *page_end_addr;
   struct page_header *header;
-  kma_page_t *page;
+  kma_page_t *table;
 
-  control = bud_info();
-  page = get_page();
+  control = bud_info(heap);
 
   header = (struct page_header*) page->ptr;
   header->page = page;
@@ -290,13 +327,18 @@ void set_new_node_page() {
   }
   prevNode->next = NULL;
 
-  int i = 0;
-  for(i=0;i<15;i++) {
-    if(control->node_list_page[i] == NULL) {
-      control->node_list_page[i] = (void*)page;
-      break;
+  /* the table doubles when it is full. */
+  if(control->node_pages == NULL
+     || (control->num_node_pages + 1) * sizeof(kma_page_t*) > control->node_pages->size) {
+    table = get_pages(control->node_pages == NULL ? 1 : 2 * NUMPAGES(control->node_pages->size));
+    if(control->node_pages != NULL) {
+      memcpy(table->ptr, control->node_pages->ptr, control->num_node_pages * sizeof(kma_page_t*));
+      free_pages(control->node_pages);
     }
+    control->node_pages = table;
   }
+  ((kma_page_t**)control->node_pages->ptr)[control->num_node_pages++] = page;
+  page->tag = control->num_node_pages;
 }
 
 /**
@@ -304,23 +346,28 @@ void set_new_node_page() {
  * call this function to allocate a new page in the 
  * page node. and use it to fit the request memory.
  **/
-void new_free_page() {
+static void new_free_page(kma_heap_t *heap) {
   struct bud_controller *control;
   struct page_node *currNode, *prevNode;
   struct free_block *blk;
-  kma_page_t *page;
+  kma_page_t *page, *pages[2];
 
-  control = bud_info();
-  
-  page = get_page();
+  control = bud_info(heap);
 
   prevNode = control->page_list.prev;
 
+  /* out of page nodes as well: take both pages in one go. */
   if(prevNode->next == NULL) {
-    set_new_node_page();
+    get_page_batch(2, pages);
+    page = pages[0];
+    set_new_node_page(heap, pages[1]);
+  }
+  else {
+    page = get_page();
   }
   currNode = prevNode->next;
   currNode->addr = page;
+  page->tag = node_tag(currNode);
   currNode->ptr = page->ptr;
   currNode->size = page->size;
   currNode->id = page->id;
@@ -338,15 +385,16 @@ void new_free_page() {
  * reduce free block size to fit request memory size.
  * Add extra space to free list array.
  **/
-void resize_block(kma_size_t reqSize, void *ptr, int blkSize) {
+static void resize_block(kma_heap_t *heap, kma_size_t reqSize, void *ptr, int blkSize) {
   struct bud_controller *control;
   struct free_block *temp, *curr;
   void *temp_ptr;
   int offset;
   int i=0;
+  int order;
   int lazy = 0;
 
-  control = bud_info();
+  control = bud_info(heap);
 
   curr = (struct free_block*)ptr;
 
@@ -367,6 +415,10 @@ void resize_block(kma_size_t reqSize, void *ptr, int blkSize) {
 
   }
 
+  for(order=0; (MIN_BLK_SIZE << order) < blkSize; order++)
+    ;
+  set_order(curr->node->order, offset, order);
+
   if(lazy == 1) {
     for(i=0; i<2*blkSize/MIN_BLK_SIZE; i++) {
       set_bit(curr->node->bitmap, i+offset);
@@ -393,14 +445,14 @@ void resize_block(kma_size_t reqSize, void *ptr, int blkSize) {
 }
 
 
-void *allocate_mem(kma_size_t size) {
+static void *allocate_mem(kma_heap_t *heap, kma_size_t size) {
 //  struct page_node *currNode;
   struct bud_controller *control;
   void *ptr;
 //  kma_page_t *page;
   int i=0;
 
-  control = bud_info();
+  control = bud_info(heap);
 
   control->used++;
 
@@ -412,19 +464,19 @@ void *allocate_mem(kma_size_t size) {
       else {
         ptr = (void*)control->freelist[i].blk->next;
         control->freelist[i].blk->next = control->freelist[i].blk->next->next;
-        resize_block(size, ptr, control->freelist[i].size);
+        resize_block(heap, size, ptr, control->freelist[i].size);
         return ptr;
       }
     }
   }
-  new_free_page();
+  new_free_page(heap);
   ptr = control->page_list.prev->ptr;
-  resize_block(size, ptr, (int)PAGESIZE);
+  resize_block(heap, size, ptr, (int)PAGESIZE);
 
   return ptr;
 }
 
-void coalescing(void *ptr, int blkSize, struct page_node *currNode) {
+static void coalescing(kma_heap_t *heap, void *ptr, int blkSize, struct page_node *currNode) {
   struct bud_controller *control;
   struct free_block *blk, *prevBlk;
 
@@ -439,7 +491,7 @@ void coalescing(void *ptr, int blkSize, struct page_node *currNode) {
   int global = 0;
 
 
-  control = bud_info();
+  control = bud_info(heap);
   
   offset = ((char*)ptr - (char*)currNode->ptr)/MIN_BLK_SIZE;
   blkOffset = blkSize / MIN_BLK_SIZE;
@@ -488,12 +540,16 @@ void coalescing(void *ptr, int blkSize, struct page_node *currNode) {
         prevBlk = blk;
         blk = blk->next;
       }
+      /* the buddy is free in pieces the lazy lists kept apart, so the
+       * block stays as it is. */
       if(found == 0) {
-        printf("error, coalescing is error\n");
+        blk = make_free_block(ptr, currNode);
+        list_blk_insert(blk, control->freelist[p].blk);
+        return;
       }
 
       blkSize = 2 * blkSize;
-      return coalescing(ptr, blkSize, currNode);
+      return coalescing(heap, ptr, blkSize, currNode);
         
     }
     else if(free == 0) {
@@ -522,10 +578,12 @@ void coalescing(void *ptr, int blkSize, struct page_node *currNode) {
         blk = blk->next;
       }
       if(found == 0) {
-        printf("error, coalescing is error\n");
+        blk = make_free_block(ptr, currNode);
+        list_blk_insert(blk, control->freelist[p].blk);
+        return;
       }
       blkSize = 2 * blkSize;
-      return coalescing(prime_ptr, blkSize, currNode);
+      return coalescing(heap, prime_ptr, blkSize, currNode);
 
     }
     else if(free == 0) {
@@ -546,81 +604,321 @@ void coalescing(void *ptr, int blkSize, struct page_node *currNode) {
 
   
 
-void*
-kma_malloc(kma_size_t size)
+static void*
+lzbud_malloc(kma_heap_t *heap, kma_size_t size)
 {
-  if(size > PAGESIZE)
-    return NULL;
-  if(page_entry == NULL)
-    init_page_entry();
+  kma_page_t *page;
 
-  return allocate_mem(size);
+  /* requests larger than a page get contiguous pages of their own */
+  if(size > PAGESIZE) {
+    page = heap_get_pages(heap, size);
+    return (page == NULL) ? NULL : page->ptr;
+  }
+  if(heap->entry == NULL)
+    init_page_entry(heap);
+
+  /* blocks are split by how often the request fits into them. */
+  if(size < MIN_BLK_SIZE)
+    size = MIN_BLK_SIZE;
+
+  return allocate_mem(heap, size);
 }
 
-void 
-kma_free(void* ptr, kma_size_t size)
-{
+/* free all the pages when every block is freed. */
+static void release_pages(kma_heap_t *heap) {
+  struct bud_controller *control;
+  struct page_node *currNode;
+  kma_page_t *batch[PAGEBATCH];
+  int n = 0;
+  int i=0;
+
+  control = bud_info(heap);
+  if(control->free != control->used)
+    return;
+
+  currNode = control->page_list.next;
+
+  while(1) {
+    batch[n++] = currNode->addr;
+    if(n == PAGEBATCH) {
+      free_page_batch(n, batch);
+      n = 0;
+    }
+    if(currNode == control->page_list.prev)
+      break;
+    currNode = currNode->next;
+  }
+  free_page_batch(n, batch);
+  n = 0;
+
+  /* the page nodes and the controller go last, the walk above reads them. */
+  for(i=0; i<control->num_node_pages; i++) {
+    batch[n++] = ((kma_page_t**)control->node_pages->ptr)[i];
+    if(n == PAGEBATCH) {
+      free_page_batch(n, batch);
+      n = 0;
+    }
+  }
+  if(control->node_pages != NULL)
+    free_pages(control->node_pages);
+  batch[n++] = heap->entry;
+  free_page_batch(n, batch);
+  heap->entry = NULL;
+}
+
+/* a block of class i left the class, freed or resized. */
+static void drop_weight(struct bud_controller *control, int i) {
+  if(control->freelist[i].weight >= 2) {
+    control->freelist[i].weight = control->freelist[i].weight - 2;
+  }
+  else if(control->freelist[i].weight == 1) {
+    control->freelist[i].weight = 0;
+  }
+  else if(control->freelist[i].weight == 0) {
+    control->freelist[i].weight = 0;
+  }
+}
+
+/* clear the bits of a block of class i, merge it with its buddies and
+ * hand every page back once all blocks are free again. */
+static void release_block(kma_heap_t *heap, void *ptr, int i, struct page_node *currNode) {
   struct bud_controller *control;
   struct free_block *curr;
-  struct page_node *currNode ;
-  void *page_begin_addr;
   int offset;
-//  kma_page_t *tempPage;
-  int i=0;
   int j=0;
 
-  control = bud_info();
+  control = bud_info(heap);
 
-  for(i=0; i<HEADERSIZE; i++) {
-    if(size <= control->freelist[i].size) {
-      curr = ptr;
-      curr->next = NULL;
-      page_begin_addr = current_page_begin_addr(ptr);
-      currNode = control->page_list.next;
-      while(currNode->ptr != page_begin_addr){
-        currNode = currNode->next;
-      }
-      curr->node = currNode;
-      offset = ((char*)ptr - (char*)currNode->ptr) / MIN_BLK_SIZE;
-      if(control->freelist[i].weight < 2) {
-        for(j=0; j< control->freelist[i].size/MIN_BLK_SIZE; j++) {
-          clear_bit(currNode->bitmap, j+offset);
-        }
-      }
-      coalescing(ptr, control->freelist[i].size, currNode);
-      if(control->freelist[i].weight >= 2) {
-        control->freelist[i].weight = control->freelist[i].weight - 2;
-      }
-      else if(control->freelist[i].weight == 1) {
-        control->freelist[i].weight = 0;
-      }
-      else if(control->freelist[i].weight == 0) {
-        control->freelist[i].weight = 0;
-      }
-      break;
+  curr = ptr;
+  curr->next = NULL;
+  curr->node = currNode;
+  offset = ((char*)ptr - (char*)currNode->ptr) / MIN_BLK_SIZE;
+  if(control->freelist[i].weight < 2) {
+    for(j=0; j< control->freelist[i].size/MIN_BLK_SIZE; j++) {
+      clear_bit(currNode->bitmap, j+offset);
     }
   }
+  coalescing(heap, ptr, control->freelist[i].size, currNode);
+  drop_weight(control, i);
 
   control->free++;
+  release_pages(heap);
+}
 
-  if(control->free == control->used) {
-    currNode = control->page_list.next;
-    
-    while(currNode != control->page_list.prev) {
-      free_page(currNode->addr);
-      currNode = currNode->next;
-    }
-    free_page(currNode->addr);
+static void 
+lzbud_free(kma_heap_t *heap, void* ptr, kma_size_t size)
+{
+  struct bud_controller *control;
+  int i=0;
 
-    for(i=0; i<15; i++) {
-      if(control->node_list_page[i] != NULL) {
-        free_page(control->node_list_page[i]);
-      }
+  if(size > PAGESIZE) {
+    heap_free_pages(heap, page_of(ptr));
+    return;
+  }
+
+  control = bud_info(heap);
+
+  for(i=0; i<HEADERSIZE - 1; i++) {
+    if(size <= control->freelist[i].size)
+      break;
+  }
+  release_block(heap, ptr, i, node_of(heap, page_of(ptr)));
+}
+
+static void
+lzbud_free_unsized(kma_heap_t *heap, void* ptr)
+{
+  struct page_node *currNode;
+  kma_page_t *page;
+
+  /* runs of pages have no page node. */
+  page = page_of(ptr);
+  if(page->tag < 0) {
+    heap_free_pages(heap, page);
+    return;
+  }
+
+  currNode = node_of(heap, page);
+  release_block(heap, ptr, get_order(currNode->order, ((char*)ptr - (char*)currNode->ptr) / MIN_BLK_SIZE),
+                currNode);
+}
+
+static kma_size_t
+lzbud_usable_size(kma_heap_t *heap, void* ptr)
+{
+  struct page_node *currNode;
+  kma_page_t *page;
+
+  /* runs of pages have no page node. */
+  page = page_of(ptr);
+  if(page->tag < 0)
+    return page->size;
+
+  currNode = node_of(heap, page);
+  return MIN_BLK_SIZE << get_order(currNode->order, ((char*)ptr - (char*)currNode->ptr) / MIN_BLK_SIZE);
+}
+
+static kma_size_t
+lzbud_good_size(kma_heap_t *heap, kma_size_t size)
+{
+  kma_size_t blkSize;
+
+  if(size > PAGESIZE)
+    return NUMPAGES(size) * PAGESIZE;
+
+  for(blkSize = MIN_BLK_SIZE; blkSize < size; blkSize *= 2)
+    ;
+  return blkSize;
+}
+
+/* splitting one block for a whole batch would upset the weights of the
+ * lazy free lists, so batches go block by block. */
+static void
+lzbud_malloc_batch(kma_heap_t *heap, kma_size_t size, int n, void* ptrs[])
+{
+  int j=0;
+
+  for(j=0; j<n; j++)
+    ptrs[j] = lzbud_malloc(heap, size);
+}
+
+static void
+lzbud_free_batch(kma_heap_t *heap, kma_size_t size, int n, void* ptrs[])
+{
+  int j=0;
+
+  for(j=0; j<n; j++)
+    lzbud_free(heap, ptrs[j], size);
+}
+
+static void*
+lzbud_memalign(kma_heap_t *heap, kma_size_t alignment, kma_size_t size)
+{
+  if(alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment > PAGESIZE)
+    return NULL;
+
+  /* a buddy is aligned to its size, as the page it is split from is,
+   * and runs start a page. */
+  if(size < alignment)
+    size = alignment;
+  return lzbud_malloc(heap, size);
+}
+
+/* grow a block of class i at ptr to class k in place by absorbing the
+ * buddies that follow it, or shrink it by handing its upper halves
+ * back. returns 0, leaving the block as it is, when a buddy on the way
+ * up is not free as a whole. */
+static int resize_in_place(kma_heap_t *heap, void *ptr, int i, int k, struct page_node *currNode) {
+  struct bud_controller *control;
+  struct free_block *blk, *prevBlk[HEADERSIZE];
+  int offset;
+  int c=0;
+  int j=0;
+
+  control = bud_info(heap);
+  offset = ((char*)ptr - (char*)currNode->ptr) / MIN_BLK_SIZE;
+
+  for(c=i; c<k; c++) {
+    if(offset % (2 * control->freelist[c].size / MIN_BLK_SIZE) != 0)
+      return 0;
+    prevBlk[c] = control->freelist[c].blk;
+    blk = prevBlk[c]->next;
+    while(blk != NULL && (char*)blk != (char*)ptr + control->freelist[c].size) {
+      prevBlk[c] = blk;
+      blk = blk->next;
     }
-    free_page(page_entry);
-    page_entry = NULL;
+    if(blk == NULL)
+      return 0;
+  }
+
+  /* the block leaves class i as a freed one does, the buddies it takes
+   * count as taken from their lists, the halves it hands back as split
+   * off. */
+  drop_weight(control, i);
+  for(c=i; c<k; c++) {
+    if(get_blk_bit(prevBlk[c]->next) == 1)
+      control->freelist[c].weight = control->freelist[c].weight + 2;
+    else
+      control->freelist[c].weight = control->freelist[c].weight + 1;
+    blk_remove(prevBlk[c]->next, prevBlk[c]);
+  }
+  for(c=i-1; c>=k; c--) {
+    blk = make_free_block((char*)ptr + control->freelist[c].size, currNode);
+    list_blk_insert(blk, control->freelist[c].blk);
+  }
+
+  for(j=0; j<control->freelist[k > i ? k : i].size/MIN_BLK_SIZE; j++) {
+    if(j < control->freelist[k].size/MIN_BLK_SIZE)
+      set_bit(currNode->bitmap, j+offset);
+    else
+      clear_bit(currNode->bitmap, j+offset);
+  }
+  set_order(currNode->order, offset, k);
+
+  return 1;
+}
+
+static void*
+lzbud_realloc(kma_heap_t *heap, void* ptr, kma_size_t old, kma_size_t size)
+{
+  struct bud_controller *control;
+  void *res;
+  int i=0, k=0;
+
+  if(ptr == NULL)
+    return lzbud_malloc(heap, size);
+  if(size == 0) {
+    lzbud_free(heap, ptr, old);
+    return NULL;
+  }
+
+  if(old > PAGESIZE) {
+    if(size > PAGESIZE && size <= page_of(ptr)->size)
+      return ptr;
   }
+  else if(size <= PAGESIZE) {
+    control = bud_info(heap);
+    for(i=0; i<HEADERSIZE - 1 && old > control->freelist[i].size; i++)
+      ;
+    for(k=0; k<HEADERSIZE - 1 && size > control->freelist[k].size; k++)
+      ;
+    if(i == k || resize_in_place(heap, ptr, i, k, node_of(heap, page_of(ptr))))
+      return ptr;
+  }
+
+  res = lzbud_malloc(heap, size);
+  if(res != NULL) {
+    memcpy(res, ptr, old < size ? old : size);
+    lzbud_free(heap, ptr, old);
+  }
+  return res;
 }
 
+static void
+lzbud_destroy(kma_heap_t *heap)
+{
+  struct bud_controller *control;
+
+  heap_free_runs(heap);
+  if(heap->entry == NULL)
+    return;
+
+  control = bud_info(heap);
+  control->free = control->used;
+  release_pages(heap);
+}
 
-#endif // KMA_LZBUD
+kma_ops_t kma_lzbud_ops =
+  {
+    .name         = "lzbud",
+    .malloc       = lzbud_malloc,
+    .free         = lzbud_free,
+    .free_unsized = lzbud_free_unsized,
+    .realloc      = lzbud_realloc,
+    .memalign     = lzbud_memalign,
+    .usable_size  = lzbud_usable_size,
+    .good_size    = lzbud_good_size,
+    .malloc_batch = lzbud_malloc_batch,
+    .free_batch   = lzbud_free_batch,
+    .destroy      = lzbud_destroy
+  };
@@ -32,7 +32,6 @@
  *    - initial version for the kernel memory allocator project
  *
  ***************************************************************************/
-#ifdef KMA_MCK2
 #define __KMA_IMPL__
 
 
@@ -40,10 +39,22 @@
 #define HEADERSIZE 10
 #define MINBLKSIZE 16
 #define MINBLK 4
-#define KMPAGESIZE 2500
+
+/* successive pages of a size class start their blocks one cache line
+ * further into the page, so that the hot blocks of a class spread over
+ * the cache sets instead of all mapping to the same few. blocks fill a
+ * page exactly, so a colored page gives up its last block as slack;
+ * classes with fewer than MINCOLORBLK blocks a page are not colored.
+ * build with KMA_COLORING=0 to turn it off. */
+#ifndef KMA_COLORING
+#define KMA_COLORING 1
+#endif
+#define CACHELINE 64
+#define MINCOLORBLK 8
 /************System include***********************************************/
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 /************Private include**********************************************/
@@ -59,7 +70,6 @@
 
 /************Global Variables*********************************************/
 
-static kma_page_t *page_entry = NULL;
 
 /************Function Prototypes******************************************/
 
@@ -78,33 +88,27 @@ struct page_header {
   kma_page_t *page;
 };
 
-struct kmem_page_header {
-  kma_page_t *page;
-  int size;
-};
-
 struct list_header {
-  int size;
+  kma_size_t size;
+  int color;
   struct free_block *blk;
 };
 
-struct advance_page {
-  int id;
-  void* ptr;
-  int size;
-  void* addr;
-};
-
+/* blocks of colored pages are aligned to a cache line only. al[] holds
+ * the blocks of uncolored pages cut for kma_memalign(), which carry
+ * their class plus HEADERSIZE in the page tag. blocks fill their pages
+ * to the end, so the pages are linked through their page structures
+ * into page_list, as many as there are. */
 struct mck2_controller {
   int used;
   int free;
-  struct advance_page add_kmem_page[10];
   struct list_header freelistarr[HEADERSIZE];
-  struct kmem_page_header kmemsizes[KMPAGESIZE];
+  struct list_header al[HEADERSIZE];
+  struct free_block page_list;
 };
 
 
-void list_insert(struct free_block *block, struct free_block  *l) {
+static void list_insert(struct free_block *block, struct free_block  *l) {
   if(l->next == NULL) {
     l->next = block;
   }
@@ -114,77 +118,79 @@ void list_insert(struct free_block *block, struct free_block  *l) {
   }
 }
 
-void init_page_entry() {
+static void init_page_entry(kma_heap_t *heap) {
   struct page_header *header;
   struct mck2_controller *control;
   struct free_block *temp;
-  kma_page_t *tempPage;
   int i=0;
-  page_entry = get_page();
+  heap->entry = get_page();
 
-  header = (struct page_header*)page_entry->ptr;
-  control = (struct mck2_controller*)((char*)page_entry->ptr + sizeof(struct page_header));
+  header = (struct page_header*)heap->entry->ptr;
+  control = (struct mck2_controller*)((char*)heap->entry->ptr + sizeof(struct page_header));
 
-  header->page = page_entry;
+  header->page = heap->entry;
   control->used = 0;
   control->free = 0;
-  
-  for(i=0; i<KMPAGESIZE/(PAGESIZE/sizeof(struct kmem_page_header)); i++) {
-      tempPage = get_page();
-      control->add_kmem_page[i].id = tempPage->id;
-      control->add_kmem_page[i].ptr = tempPage->ptr;
-      control->add_kmem_page[i].size = tempPage->size;
-      control->add_kmem_page[i].addr = (void*)tempPage;
-  }
+
   /* initial all the struct in the list */
   for(i=0; i<HEADERSIZE; i++) {
     control->freelistarr[i].size = (int)(pow((double)2,(double) (i+4)));
-    temp = (struct free_block*)((char*)page_entry->ptr + sizeof(struct page_header) 
+    control->freelistarr[i].color = 0;
+    temp = (struct free_block*)((char*)heap->entry->ptr + sizeof(struct page_header) 
         + sizeof(struct mck2_controller) + i * (sizeof(struct free_block)));
     control->freelistarr[i].blk = temp;
     control->freelistarr[i].blk->next = NULL;
+
+    control->al[i].size = control->freelistarr[i].size;
+    control->al[i].color = 0;
+    temp = (struct free_block*)((char*)heap->entry->ptr + sizeof(struct page_header) 
+        + sizeof(struct mck2_controller) + (HEADERSIZE + i) * (sizeof(struct free_block)));
+    control->al[i].blk = temp;
+    control->al[i].blk->next = NULL;
   }
-  
-  /* initial kmemsize[]. size = 0 means unallocated. */
-  for(i=0; i<KMPAGESIZE; i++) {
-    control->kmemsizes[i].size = 0;
-    control->kmemsizes[i].page = NULL;
-  }
-  
+  control->page_list.next = NULL;
 }
 
 
 /* get controller infomation */
-void *mck2_info() {
+static void *mck2_info(kma_heap_t *heap) {
   void *ptr;
-  ptr = (struct mck2_controller*)((char*)page_entry->ptr + sizeof(struct page_header));
+  ptr = (struct mck2_controller*)((char*)heap->entry->ptr + sizeof(struct page_header));
 
   return ptr;
 }
 
 
 
+/* offset of the first block in the next page of a class, rotating
+ * through as many cache lines as fit into the slack of a page */
+static int next_color(struct list_header *l, int slack) {
+  int colors = slack / CACHELINE;
+  int offset;
+
+  if(!KMA_COLORING || colors <= 1)
+    return 0;
+
+  offset = l->color * CACHELINE;
+  l->color = (l->color + 1) % colors;
+  return offset;
+}
+
 /* get a new page to store free block */
-void new_free_block(struct list_header *l) {
+static void new_free_block(kma_heap_t *heap, struct list_header *l) {
   struct mck2_controller *control;
   struct free_block *curr;
   kma_page_t *page;
   void *page_end_addr;
 
-  control = mck2_info();
+  control = mck2_info(heap);
 
-  /* initial a new page. */
+  /* initial a new page, remembering its class so that blocks can be
+   * freed without their size. */
   page = get_page();
-  int i=0;
-  for(i=0; i<KMPAGESIZE; i++) {
-    if(control->kmemsizes[i].size == 0) {
-      control->kmemsizes[i].page = page;
-      control->kmemsizes[i].size = l->size;
-      break;
-    }
-  }
-  page_end_addr = (char*)(control->kmemsizes[i].page->ptr) + PAGESIZE;
-  curr = (struct free_block *)(char*)(control->kmemsizes[i].page->ptr);
+  page->tag = l - control->freelistarr + 1;
+  page_end_addr = (char*)page->ptr + PAGESIZE;
+  curr = (struct free_block *)page->ptr;
   curr->next = (struct free_block *)NULL;
   
   /* divide this page into the same size of free block as request. */
@@ -193,27 +199,75 @@ void new_free_block(struct list_header *l) {
 
   }
   else {
-    while((char*)curr + l->size < (char*)page_end_addr) {
+    if(l->size <= PAGESIZE / MINCOLORBLK)
+      curr = (struct free_block*)((char*)curr + next_color(l, l->size));
+    while((char*)curr + l->size <= (char*)page_end_addr) {
       curr->next = NULL;
       list_insert(curr, l->blk);
       curr = (struct free_block*)((char*)curr + l->size);
     }
   }
-  
+
+  /* add this page into page_list */
+  curr = (void*)page;
+  curr->next = NULL;
+  list_insert(curr, &control->page_list);
 }
 
 
-void *mem_allocate(kma_size_t size) {
+/* whether class i is cut into colored pages. */
+static int colored(kma_heap_t *heap, int i) {
+  struct mck2_controller *control;
+
+  control = mck2_info(heap);
+  return KMA_COLORING && control->freelistarr[i].size > CACHELINE
+    && control->freelistarr[i].size <= PAGESIZE / MINCOLORBLK;
+}
+
+/* get a new uncolored page of blocks for the aligned list of class i. */
+static void new_aligned_block(kma_heap_t *heap, int i) {
+  struct mck2_controller *control;
+  struct free_block *curr;
+  kma_page_t *page;
+
+  control = mck2_info(heap);
+
+  page = get_page();
+  page->tag = HEADERSIZE + i + 1;
+  for(curr = page->ptr; (char*)curr + control->al[i].size <= (char*)page->ptr + PAGESIZE;
+      curr = (struct free_block*)((char*)curr + control->al[i].size)) {
+    curr->next = NULL;
+    list_insert(curr, control->al[i].blk);
+  }
+
+  curr = (void*)page;
+  curr->next = NULL;
+  list_insert(curr, &control->page_list);
+}
+
+/* the list a block of class i goes back to. only blocks at the natural
+ * alignment of a colored class can come from an aligned page. */
+static struct list_header *list_of(kma_heap_t *heap, void *ptr, int i) {
+  struct mck2_controller *control;
+
+  control = mck2_info(heap);
+  if(colored(heap, i) && ((unsigned long)ptr & (control->freelistarr[i].size - 1)) == 0
+     && page_of(ptr)->tag > HEADERSIZE)
+    return &control->al[i];
+  return &control->freelistarr[i];
+}
+
+static void *mem_allocate(kma_heap_t *heap, kma_size_t size) {
   struct mck2_controller *control;
   void *ptr;
   int  i=0;
   
-  control = mck2_info();
+  control = mck2_info(heap);
 
   for(i = 0; i<HEADERSIZE; i++) {
     if(size <= control->freelistarr[i].size) {
       if(control->freelistarr[i].blk->next == NULL) {
-        new_free_block(&control->freelistarr[i]);
+        new_free_block(heap, &control->freelistarr[i]);
       }
       ptr = (void*)control->freelistarr[i].blk->next;
     
@@ -228,58 +282,286 @@ void *mem_allocate(kma_size_t size) {
 }
 
 
-void*
-kma_malloc(kma_size_t size)
+static void*
+mck2_malloc(kma_heap_t *heap, kma_size_t size)
 {
-  if(size >= PAGESIZE) 
-    return NULL;
-  if(page_entry == NULL)
-    init_page_entry();
+  kma_page_t *page;
+
+  /* requests larger than a page get contiguous pages of their own */
+  if(size > PAGESIZE) {
+    page = heap_get_pages(heap, size);
+    return (page == NULL) ? NULL : page->ptr;
+  }
+  if(heap->entry == NULL)
+    init_page_entry(heap);
+
+
+  return mem_allocate(heap, size);
+}
+
+/* free all the page when request memory number = free memory number. */
+static void release_pages(kma_heap_t *heap) {
+  struct mck2_controller *control;
+  struct free_block *curr, *temp;
+  kma_page_t *batch[PAGEBATCH];
+  int n = 0;
+
+  control = mck2_info(heap);
+  if(control->used != control->free)
+    return;
+
+  curr = control->page_list.next;
+  while(curr != NULL) {
+    temp = curr->next;
+    batch[n++] = (kma_page_t*)curr;
+    if(n == PAGEBATCH) {
+      free_page_batch(n, batch);
+      n = 0;
+    }
+    curr = temp;
+  }
+  batch[n++] = heap->entry;
+  free_page_batch(n, batch);
+
+  heap->entry = NULL;
+}
+
+/* re-add a block to the list of its class i. */
+static void release_block(kma_heap_t *heap, void *ptr, int i) {
+  struct mck2_controller *control;
+  struct free_block *curr;
 
+  control = mck2_info(heap);
 
-  return mem_allocate(size);
+  curr = ptr;
+  curr->next = NULL;
+  list_insert(curr, list_of(heap, ptr, i)->blk);
+
+  control->free++;
+  release_pages(heap);
 }
 
-void
-kma_free(void* ptr, kma_size_t size)
+static void
+mck2_free(kma_heap_t *heap, void* ptr, kma_size_t size)
 {
-  
   struct mck2_controller *control;
-  struct free_block *curr ;
-  kma_page_t *tempPage;
   int i=0;
 
-  control = mck2_info();
+  if(size > PAGESIZE) {
+    heap_free_pages(heap, page_of(ptr));
+    return;
+  }
+
+  control = mck2_info(heap);
 
   /* free specific memory and re-add it to original list */
-  for(i=0; i<HEADERSIZE; i++) {
-    if(size <= control->freelistarr[i].size ) {
-      curr = ptr;
-      curr->next = NULL;
-      list_insert(curr, (control->freelistarr[i].blk));
+  for(i=0; i<HEADERSIZE - 1; i++) {
+    if(size <= control->freelistarr[i].size)
       break;
-    }
   }
+  release_block(heap, ptr, i);
+}
 
-  control->free++;
+static void
+mck2_free_unsized(kma_heap_t *heap, void* ptr)
+{
+  kma_page_t *page;
 
-  /* free all the page when request memory number = free memory number. */
-  if(control->used == control->free) {
-    for(i=0; i<KMPAGESIZE; i++) {
-      if(control->kmemsizes[i].size != 0) {
-        free_page(control->kmemsizes[i].page);
-      }
+  /* runs of pages carry no class. */
+  page = page_of(ptr);
+  if(page->tag < 0) {
+    heap_free_pages(heap, page);
+    return;
+  }
+
+  release_block(heap, ptr, (page->tag - 1) % HEADERSIZE);
+}
+
+static kma_size_t
+mck2_usable_size(kma_heap_t *heap, void* ptr)
+{
+  struct mck2_controller *control;
+  kma_page_t *page;
+
+  /* runs of pages carry no class. */
+  page = page_of(ptr);
+  if(page->tag < 0)
+    return page->size;
+
+  control = mck2_info(heap);
+  return control->freelistarr[(page->tag - 1) % HEADERSIZE].size;
+}
+
+static kma_size_t
+mck2_good_size(kma_heap_t *heap, kma_size_t size)
+{
+  kma_size_t blkSize;
+
+  if(size > PAGESIZE)
+    return NUMPAGES(size) * PAGESIZE;
+
+  for(blkSize = MINBLKSIZE; blkSize < size; blkSize *= 2)
+    ;
+  return blkSize;
+}
+
+static void
+mck2_malloc_batch(kma_heap_t *heap, kma_size_t size, int n, void* ptrs[])
+{
+  struct mck2_controller *control;
+  struct list_header *l;
+  struct free_block *curr;
+  int i=0, j=0;
+
+  if(size > PAGESIZE) {
+    for(j=0; j<n; j++)
+      ptrs[j] = mck2_malloc(heap, size);
+    return;
+  }
+  if(heap->entry == NULL)
+    init_page_entry(heap);
+
+  control = mck2_info(heap);
+  for(i=0; i<HEADERSIZE - 1 && size > control->freelistarr[i].size; i++)
+    ;
+  l = &control->freelistarr[i];
+
+  /* pop the blocks off the list in one pass, cutting new pages as the
+   * list runs dry. */
+  curr = l->blk->next;
+  for(j=0; j<n; j++) {
+    if(curr == NULL) {
+      l->blk->next = NULL;
+      new_free_block(heap, l);
+      curr = l->blk->next;
     }
-    i = 0;
-    for(i=0; i<KMPAGESIZE/(PAGESIZE/sizeof(struct kmem_page_header)); i++) {
-      tempPage = (kma_page_t*)control->add_kmem_page[i].addr;
-      free_page(tempPage);
-    } 
-    free_page(page_entry);
-  
-    page_entry = NULL;
-  } 
+    ptrs[j] = curr;
+    curr = curr->next;
+  }
+  l->blk->next = curr;
+  control->used += n;
+}
+
+static void
+mck2_free_batch(kma_heap_t *heap, kma_size_t size, int n, void* ptrs[])
+{
+  struct mck2_controller *control;
+  struct free_block *curr;
+  int i=0, j=0;
+
+  if(size > PAGESIZE) {
+    for(j=0; j<n; j++)
+      heap_free_pages(heap, page_of(ptrs[j]));
+    return;
+  }
+
+  control = mck2_info(heap);
+  for(i=0; i<HEADERSIZE - 1 && size > control->freelistarr[i].size; i++)
+    ;
+
+  for(j=0; j<n; j++) {
+    curr = ptrs[j];
+    curr->next = NULL;
+    list_insert(curr, list_of(heap, curr, i)->blk);
+  }
+  control->free += n;
+  release_pages(heap);
+}
+
+static void*
+mck2_memalign(kma_heap_t *heap, kma_size_t alignment, kma_size_t size)
+{
+  struct mck2_controller *control;
+  struct free_block *ptr;
+  int i=0;
+
+  if(alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment > PAGESIZE)
+    return NULL;
+  if(size < alignment)
+    size = alignment;
+  /* runs start a page. */
+  if(size > PAGESIZE)
+    return mck2_malloc(heap, size);
+  if(heap->entry == NULL)
+    init_page_entry(heap);
+
+  control = mck2_info(heap);
+  for(i=0; i<HEADERSIZE - 1 && size > control->freelistarr[i].size; i++)
+    ;
+  /* blocks are aligned to their size, in colored pages to a cache line. */
+  if(!colored(heap, i) || alignment <= CACHELINE)
+    return mem_allocate(heap, size);
+
+  if(control->al[i].blk->next == NULL)
+    new_aligned_block(heap, i);
+  ptr = control->al[i].blk->next;
+  control->al[i].blk->next = ptr->next;
+
+  control->used++;
+  return ptr;
+}
+
+static void*
+mck2_realloc(kma_heap_t *heap, void* ptr, kma_size_t old, kma_size_t size)
+{
+  struct mck2_controller *control;
+  void *res;
+  int i=0, j=0;
+
+  if(ptr == NULL)
+    return mck2_malloc(heap, size);
+  if(size == 0) {
+    mck2_free(heap, ptr, old);
+    return NULL;
+  }
+
+  if(old > PAGESIZE) {
+    if(size > PAGESIZE && size <= page_of(ptr)->size)
+      return ptr;
+  }
+  else if(size <= PAGESIZE) {
+    control = mck2_info(heap);
+    for(i=0; i<HEADERSIZE - 1 && old > control->freelistarr[i].size; i++)
+      ;
+    for(j=0; j<HEADERSIZE - 1 && size > control->freelistarr[j].size; j++)
+      ;
+    if(i == j)
+      return ptr;
+  }
+
+  res = mck2_malloc(heap, size);
+  if(res != NULL) {
+    memcpy(res, ptr, old < size ? old : size);
+    mck2_free(heap, ptr, old);
+  }
+  return res;
+}
+
+static void
+mck2_destroy(kma_heap_t *heap)
+{
+  struct mck2_controller *control;
+
+  heap_free_runs(heap);
+  if(heap->entry == NULL)
+    return;
 
+  control = mck2_info(heap);
+  control->free = control->used;
+  release_pages(heap);
 }
 
-#endif // KMA_MCK2
+kma_ops_t kma_mck2_ops =
+  {
+    .name         = "mck2",
+    .malloc       = mck2_malloc,
+    .free         = mck2_free,
+    .free_unsized = mck2_free_unsized,
+    .realloc      = mck2_realloc,
+    .memalign     = mck2_memalign,
+    .usable_size  = mck2_usable_size,
+    .good_size    = mck2_good_size,
+    .malloc_batch = mck2_malloc_batch,
+    .free_batch   = mck2_free_batch,
+    .destroy      = mck2_destroy
+  };
@@ -0,0 +1,400 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Selects the allocator backend at runtime and forwards the
+ *             kma_*() calls to it
+ ***************************************************************************/
+#define __KMA_IMPL__
+
+/************System include***********************************************/
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+/* the backend used when KMA_ALLOCATOR is not set, binaries built with
+ * -DKMA_RM and so on default to that one */
+#if defined(KMA_DUMMY)
+#define KMA_DEFAULT "dummy"
+#elif defined(KMA_RM)
+#define KMA_DEFAULT "rm"
+#elif defined(KMA_P2FL)
+#define KMA_DEFAULT "p2fl"
+#elif defined(KMA_MCK2)
+#define KMA_DEFAULT "mck2"
+#elif defined(KMA_LZBUD)
+#define KMA_DEFAULT "lzbud"
+#else
+#define KMA_DEFAULT "bud"
+#endif
+
+/* heap structures are carved from slab pages, the slabs go back once no
+ * heap is left */
+typedef struct heap_slab
+{
+  kma_page_t* page;
+  struct heap_slab* next;
+  kma_heap_t heaps[];
+} heap_slab_t;
+
+#define SLABHEAPS ((PAGESIZE - sizeof(heap_slab_t)) / sizeof(kma_heap_t))
+
+/************Global Variables*********************************************/
+
+kma_ops_t* kma_backends[] =
+  {
+    &kma_dummy_ops,
+    &kma_rm_ops,
+    &kma_p2fl_ops,
+    &kma_mck2_ops,
+    &kma_bud_ops,
+    &kma_lzbud_ops,
+    NULL
+  };
+
+/* the heap of the kma_*() functions, its backend is NULL until the
+ * first call */
+static kma_heap_t gHeap = { NULL, NULL, NULL, 0, FALSE, NULL };
+
+/* the slabs, their free heap structures and the heaps created */
+static heap_slab_t* gSlabs = NULL;
+static kma_heap_t* gFreeHeaps = NULL;
+static int gHeaps = 0;
+static pthread_mutex_t gSlabLock = PTHREAD_MUTEX_INITIALIZER;
+
+/************Function Prototypes******************************************/
+static kma_ops_t* findBackend(char*);
+static void initBackend();
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+bool
+kma_select(char* name)
+{
+  kma_ops_t* ops;
+
+  // the controller of the backend in use would be read as one of the
+  // new backend's, so the backend stays while any memory is allocated
+  ops = findBackend(name);
+  if (ops == NULL
+      || ((gHeap.entry != NULL || gHeap.runs != NULL) && ops != gHeap.ops))
+    {
+      return FALSE;
+    }
+  gHeap.ops = ops;
+  return TRUE;
+}
+
+kma_ops_t*
+kma_backend()
+{
+  if (gHeap.ops == NULL)
+    {
+      initBackend();
+    }
+  return gHeap.ops;
+}
+
+void*
+kma_malloc(kma_size_t size)
+{
+  return kma_backend()->malloc(&gHeap, size);
+}
+
+void
+kma_free(void* ptr, kma_size_t size)
+{
+  kma_backend()->free(&gHeap, ptr, size);
+}
+
+void
+kma_free_unsized(void* ptr)
+{
+  kma_backend()->free_unsized(&gHeap, ptr);
+}
+
+void*
+kma_realloc(void* ptr, kma_size_t old, kma_size_t size)
+{
+  return kma_backend()->realloc(&gHeap, ptr, old, size);
+}
+
+void*
+kma_calloc(kma_size_t n, kma_size_t size)
+{
+  kma_backend();
+  return kma_heap_calloc(&gHeap, n, size);
+}
+
+void*
+kma_memalign(kma_size_t alignment, kma_size_t size)
+{
+  return kma_backend()->memalign(&gHeap, alignment, size);
+}
+
+kma_size_t
+kma_usable_size(void* ptr)
+{
+  return kma_backend()->usable_size(&gHeap, ptr);
+}
+
+kma_size_t
+kma_good_size(kma_size_t size)
+{
+  return kma_backend()->good_size(&gHeap, size);
+}
+
+void
+kma_malloc_batch(kma_size_t size, int n, void* ptrs[])
+{
+  kma_backend()->malloc_batch(&gHeap, size, n, ptrs);
+}
+
+void
+kma_free_batch(kma_size_t size, int n, void* ptrs[])
+{
+  kma_backend()->free_batch(&gHeap, size, n, ptrs);
+}
+
+kma_heap_t*
+kma_heap_create(char* name)
+{
+  kma_ops_t* ops;
+  kma_page_t* page;
+  heap_slab_t* slab;
+  kma_heap_t* heap;
+  int i;
+
+  ops = (name == NULL) ? kma_backend() : findBackend(name);
+  if (ops == NULL)
+    {
+      return NULL;
+    }
+
+  // the backend gets its controller page on first use, like the
+  // default heap, so only the structure is needed now
+  pthread_mutex_lock(&gSlabLock);
+  if (gFreeHeaps == NULL)
+    {
+      page = get_page();
+      slab = page->ptr;
+      slab->page = page;
+      slab->next = gSlabs;
+      gSlabs = slab;
+      for (i = 0; i < SLABHEAPS; i++)
+	{
+	  slab->heaps[i].next = gFreeHeaps;
+	  gFreeHeaps = &slab->heaps[i];
+	}
+    }
+  heap = gFreeHeaps;
+  gFreeHeaps = heap->next;
+  gHeaps++;
+  pthread_mutex_unlock(&gSlabLock);
+
+  heap->ops = ops;
+  heap->entry = NULL;
+  heap->runs = NULL;
+  heap->num_runs = 0;
+  heap->zeroed = FALSE;
+  heap->next = NULL;
+  return heap;
+}
+
+void
+kma_heap_destroy(kma_heap_t* heap)
+{
+  heap_slab_t* slab;
+
+  heap->ops->destroy(heap);
+
+  pthread_mutex_lock(&gSlabLock);
+  heap->next = gFreeHeaps;
+  gFreeHeaps = heap;
+  if (--gHeaps == 0)
+    {
+      while (gSlabs != NULL)
+	{
+	  slab = gSlabs;
+	  gSlabs = slab->next;
+	  free_page(slab->page);
+	}
+      gFreeHeaps = NULL;
+    }
+  pthread_mutex_unlock(&gSlabLock);
+}
+
+void*
+kma_heap_malloc(kma_heap_t* heap, kma_size_t size)
+{
+  return heap->ops->malloc(heap, size);
+}
+
+void
+kma_heap_free(kma_heap_t* heap, void* ptr, kma_size_t size)
+{
+  heap->ops->free(heap, ptr, size);
+}
+
+void*
+kma_heap_calloc(kma_heap_t* heap, kma_size_t n, kma_size_t size)
+{
+  void* ptr;
+
+  if (__builtin_mul_overflow(n, size, &size))
+    {
+      return NULL;
+    }
+
+  // a run comes zero-filled from heap_get_pages(), which takes the
+  // flag, so that only the pages that need it are cleared. blocks
+  // carved from the pages of the backend are cleared here
+  heap->zeroed = TRUE;
+  ptr = heap->ops->malloc(heap, size);
+  if (heap->zeroed)
+    {
+      heap->zeroed = FALSE;
+      if (ptr != NULL)
+	{
+	  memset(ptr, 0, size);
+	}
+    }
+  return ptr;
+}
+
+kma_page_t*
+heap_get_pages(kma_heap_t* heap, kma_size_t size)
+{
+  kma_page_t* page;
+  kma_page_t* table;
+  kma_page_t** runs;
+  int n;
+
+  // the page count has to fit an int, which also keeps NUMPAGES() from
+  // wrapping around
+  if (size > (kma_size_t) INT_MAX * PAGESIZE)
+    {
+      heap->zeroed = FALSE;
+      return NULL;
+    }
+  n = NUMPAGES(size);
+
+  if (heap->zeroed)
+    {
+      page = get_zeroed_pages(n);
+      heap->zeroed = FALSE;
+    }
+  else
+    {
+      page = get_pages(n);
+    }
+
+  // the table doubles when it is full
+  if (heap->runs == NULL
+      || (heap->num_runs + 1) * sizeof(kma_page_t*) > heap->runs->size)
+    {
+      table = get_pages(heap->runs == NULL ? 1 : 2 * NUMPAGES(heap->runs->size));
+      if (heap->runs != NULL)
+	{
+	  memcpy(table->ptr, heap->runs->ptr, heap->num_runs * sizeof(kma_page_t*));
+	  free_pages(heap->runs);
+	}
+      heap->runs = table;
+    }
+  runs = heap->runs->ptr;
+  runs[heap->num_runs++] = page;
+  page->tag = -heap->num_runs;
+  return page;
+}
+
+void
+heap_free_pages(kma_heap_t* heap, kma_page_t* page)
+{
+  kma_page_t** runs;
+  int i;
+
+  // the last run of the table moves into the place of the one freed
+  runs = heap->runs->ptr;
+  i = -page->tag - 1;
+  runs[i] = runs[--heap->num_runs];
+  runs[i]->tag = -(i + 1);
+  free_pages(page);
+
+  if (heap->num_runs == 0)
+    {
+      free_pages(heap->runs);
+      heap->runs = NULL;
+    }
+}
+
+void
+heap_free_runs(kma_heap_t* heap)
+{
+  kma_page_t** runs;
+  int i;
+
+  if (heap->runs == NULL)
+    {
+      return;
+    }
+  runs = heap->runs->ptr;
+  for (i = 0; i < heap->num_runs; i++)
+    {
+      free_pages(runs[i]);
+    }
+  free_pages(heap->runs);
+  heap->runs = NULL;
+  heap->num_runs = 0;
+}
+
+static kma_ops_t*
+findBackend(char* name)
+{
+  kma_ops_t** ops;
+
+  if (strncasecmp(name, "KMA_", 4) == 0)
+    {
+      name += 4;
+    }
+  for (ops = kma_backends; *ops != NULL; ops++)
+    {
+      if (strcasecmp((*ops)->name, name) == 0)
+	{
+	  return *ops;
+	}
+    }
+  return NULL;
+}
+
+/* threads racing here all pick the same backend */
+static void
+initBackend()
+{
+  char* value;
+
+  if ((value = getenv("KMA_ALLOCATOR")) != NULL && value[0] != '\0')
+    {
+      if (!kma_select(value))
+	{
+	  error("unknown allocator backend", value);
+	}
+    }
+  else
+    {
+      kma_select(KMA_DEFAULT);
+    }
+}
@@ -32,7 +32,6 @@
  *    - initial version for the kernel memory allocator project
  *
  ***************************************************************************/
-#ifdef KMA_P2FL
 #define __KMA_IMPL__
 
 
@@ -40,9 +39,20 @@
 #define MINBLKSIZE 16
 #define MINBLK 4
 
+/* successive pages of a size class start their blocks one cache line
+ * further into the page, as far as the slack at the end of the page
+ * allows, so that the hot blocks of a class spread over the cache sets
+ * instead of all mapping to the same few. build with KMA_COLORING=0 to
+ * turn it off. */
+#ifndef KMA_COLORING
+#define KMA_COLORING 1
+#endif
+#define CACHELINE 64
+
 /************System include***********************************************/
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include <math.h>
 
 /************Private include**********************************************/
@@ -58,7 +68,6 @@
 
 /************Global Variables*********************************************/
 
-static kma_page_t *page_entry = NULL;
 
 /************Function Prototypes******************************************/
 
@@ -79,19 +88,25 @@ struct page_header {
 
 
 struct list_header {
-  int size;
-  int avai_size;
+  kma_size_t size;
+  kma_size_t avai_size;
+  int color;
   struct free_block *blk;
 };
 
+/* blocks sit behind the page header, so none is aligned to more than
+ * that. al[] holds the blocks of pages cut without header and coloring
+ * for kma_memalign(), every one aligned to its size. these have no
+ * header to spare, so the whole block is available. */
 struct p2fl_controller {
   int used;
   int free;
   struct list_header lh[HEADERSIZE];
   struct list_header page_list;
+  struct list_header al[HEADERSIZE];
 };
 
-void list_insert(struct free_block *block, struct free_block  *l) {
+static void list_insert(struct free_block *block, struct free_block  *l) {
   if(l->next == NULL) {
     l->next = block;
   }
@@ -104,16 +119,16 @@ void list_insert(struct free_block *block, struct free_block  *l) {
 
 
 
-void init_page_entry() {
+static void init_page_entry(kma_heap_t *heap) {
   struct page_header *header;
   struct p2fl_controller *control;
   struct free_block *temp;
-  page_entry = get_page();
+  heap->entry = get_page();
 
-  header = (struct page_header*)page_entry->ptr;
-  control = (struct p2fl_controller*)((char*)page_entry->ptr + sizeof(struct page_header));
+  header = (struct page_header*)heap->entry->ptr;
+  control = (struct p2fl_controller*)((char*)heap->entry->ptr + sizeof(struct page_header));
 
-  header->page = page_entry;
+  header->page = heap->entry;
   control->used = 0;
   control->free = 0;
   
@@ -122,45 +137,71 @@ void init_page_entry() {
   for(i=0; i<HEADERSIZE; i++) {
     control->lh[i].size = (int)(pow((double)2,(double) (i+4)));
     control->lh[i].avai_size = control->lh[i].size - sizeof(struct free_block);
-    temp = (struct free_block*)((char*)page_entry->ptr + sizeof(struct page_header) 
+    control->lh[i].color = 0;
+    temp = (struct free_block*)((char*)heap->entry->ptr + sizeof(struct page_header) 
         + sizeof(struct p2fl_controller) + i * (sizeof(struct free_block)));
     control->lh[i].blk = temp;
     control->lh[i].blk->next = NULL;
   }
   control->page_list.size = 0;
   control->page_list.avai_size = 0;
-  temp = (struct free_block*)((char*)page_entry->ptr + sizeof(struct page_header) 
+  temp = (struct free_block*)((char*)heap->entry->ptr + sizeof(struct page_header) 
         + sizeof(struct p2fl_controller) + HEADERSIZE * (sizeof(struct free_block)));
   control->page_list.blk = temp;
   control->page_list.blk->next = NULL;
-  
-  
+
+  for(i=0; i<HEADERSIZE; i++) {
+    control->al[i].size = control->lh[i].size;
+    control->al[i].avai_size = control->al[i].size;
+    control->al[i].color = 0;
+    temp = (struct free_block*)((char*)heap->entry->ptr + sizeof(struct page_header) 
+        + sizeof(struct p2fl_controller) + (HEADERSIZE + 1 + i) * (sizeof(struct free_block)));
+    control->al[i].blk = temp;
+    control->al[i].blk->next = NULL;
+  }
 }
 
 /* get controller infomation */
-void *plfl_info() {
+static void *plfl_info(kma_heap_t *heap) {
   void *ptr;
-  ptr = (struct p2fl_controller*)((char*)page_entry->ptr + sizeof(struct page_header));
+  ptr = (struct p2fl_controller*)((char*)heap->entry->ptr + sizeof(struct page_header));
 
   return ptr;
 }
 
+/* offset of the first block in the next page of a class, rotating
+ * through as many cache lines as fit into the slack of a page */
+static int next_color(struct list_header *l, int slack) {
+  int colors = slack / CACHELINE;
+  int offset;
+
+  if(!KMA_COLORING || colors <= 1)
+    return 0;
+
+  offset = l->color * CACHELINE;
+  l->color = (l->color + 1) % colors;
+  return offset;
+}
+
 /* get a new page to store free block */
-void new_free_block(struct list_header *l) {
+static void new_free_block(kma_heap_t *heap, struct list_header *l) {
   struct p2fl_controller *control;
   struct free_block *curr;
   struct page_header *header;
   kma_page_t *page;
   void *page_end_addr;
 
-  control = plfl_info();
+  control = plfl_info(heap);
 
   /* initial a new page. */
   page = get_page();
+  /* remember the class in the page, so that blocks can be freed without
+   * their size. */
+  page->tag = l - control->lh + 1;
   header = (struct page_header*)page->ptr;
   header->page = page;
   page_end_addr = (char*)header + PAGESIZE;
-  curr = (struct free_block *)(char*)header + sizeof(struct page_header);
+  curr = (struct free_block *)((char*)header + sizeof(struct page_header));
   curr->next = (struct free_block *)NULL;
   
   /* divide this page into the same size of free block as request. */
@@ -169,7 +210,9 @@ void new_free_block(struct list_header *l) {
 
   }
   else {
-    while((char*)curr + l->size < (char*)page_end_addr) {
+    curr = (struct free_block*)((char*)curr
+        + next_color(l, (PAGESIZE - sizeof(struct page_header)) % l->size));
+    while((char*)curr + l->size <= (char*)page_end_addr) {
       curr->next = NULL;
       list_insert(curr, l->blk);
       curr = (struct free_block*)((char*)curr + l->size);
@@ -185,17 +228,58 @@ void new_free_block(struct list_header *l) {
 
 }
 
-void *mem_allocate(kma_size_t size) {
+/* get a new page of aligned blocks for class i. */
+static void new_aligned_block(kma_heap_t *heap, int i) {
+  struct p2fl_controller *control;
+  struct free_block *curr;
+  kma_page_t *page;
+
+  control = plfl_info(heap);
+
+  page = get_page();
+  page->tag = i + 1;
+  for(curr = page->ptr; (char*)curr + control->al[i].size <= (char*)page->ptr + PAGESIZE;
+      curr = (struct free_block*)((char*)curr + control->al[i].size)) {
+    curr->next = NULL;
+    list_insert(curr, control->al[i].blk);
+  }
+
+  curr = (void*)page;
+  curr->next = NULL;
+  list_insert(curr, control->page_list.blk);
+}
+
+/* the lists of the classes a block belongs to. aligned blocks are the
+ * only ones aligned to twice the page header. */
+static struct list_header *lists_of(kma_heap_t *heap, void *ptr) {
+  struct p2fl_controller *control;
+
+  control = plfl_info(heap);
+  if(((unsigned long)ptr & (2 * sizeof(struct page_header) - 1)) == 0)
+    return control->al;
+  return control->lh;
+}
+
+/* the class in lists l that size bytes fall into. */
+static int class_of(struct list_header *l, kma_size_t size) {
+  int i=0;
+
+  for(i=0; i<HEADERSIZE - 1 && size > l[i].avai_size; i++)
+    ;
+  return i;
+}
+
+static void *mem_allocate(kma_heap_t *heap, kma_size_t size) {
   struct p2fl_controller *control;
   void *ptr;
   int  i=0;
   
-  control = plfl_info();
+  control = plfl_info(heap);
 
   for(i = 0; i<HEADERSIZE; i++) {
     if(size <= control->lh[i].avai_size) {
       if(control->lh[i].blk->next == NULL) {
-        new_free_block(&control->lh[i]);
+        new_free_block(heap, &control->lh[i]);
       }
       ptr = (void*)control->lh[i].blk->next;
     
@@ -210,54 +294,268 @@ void *mem_allocate(kma_size_t size) {
 }
 
 
-void*
-kma_malloc(kma_size_t size)
+static void*
+p2fl_malloc(kma_heap_t *heap, kma_size_t size)
 {
-  if(size >= PAGESIZE)
-    return NULL;
-  if(page_entry == NULL)
-    init_page_entry();
+  kma_page_t *page;
 
-  return mem_allocate(size);
+  /* requests larger than a page get contiguous pages of their own */
+  if(size > PAGESIZE - sizeof(struct page_header)) {
+    page = heap_get_pages(heap, size);
+    return (page == NULL) ? NULL : page->ptr;
+  }
+  if(heap->entry == NULL)
+    init_page_entry(heap);
+
+  return mem_allocate(heap, size);
 }
 
-void
-kma_free(void* ptr, kma_size_t size)
-{
+/* free all the page when request memory number = free memory number. */
+static void release_pages(kma_heap_t *heap) {
   struct p2fl_controller *control;
   struct free_block *curr, *temp;
-  int i=0;
+  kma_page_t *batch[PAGEBATCH];
+  int n = 0;
+
+  control = plfl_info(heap);
+  if(control->used != control->free)
+    return;
+
+  curr = control->page_list.blk->next;
+  while(curr != NULL) {
+    temp = curr->next;
+    batch[n++] = (kma_page_t*)curr;
+    if(n == PAGEBATCH) {
+      free_page_batch(n, batch);
+      n = 0;
+    }
+    curr = temp;
+  }
+
+  batch[n++] = heap->entry;
+  free_page_batch(n, batch);
+  heap->entry = NULL;
+}
+
+/* re-add a block to the list l of its class. */
+static void release_block(kma_heap_t *heap, void *ptr, struct list_header *l) {
+  struct p2fl_controller *control;
+  struct free_block *curr;
+
+  control = plfl_info(heap);
+
+  curr = ptr;
+  curr->next = NULL;
+  list_insert(curr, l->blk);
+
+  control->free++;
+  release_pages(heap);
+}
 
-  control = plfl_info();
+static void
+p2fl_free(kma_heap_t *heap, void* ptr, kma_size_t size)
+{
+  struct list_header *l;
+
+  if(size > PAGESIZE - sizeof(struct page_header)) {
+    heap_free_pages(heap, page_of(ptr));
+    return;
+  }
 
   /* free specific memory and re-add it to original list */
-  for(i=0; i<HEADERSIZE; i++) {
-    if(size <= control->lh[i].avai_size ) {
-      curr = ptr;
-      curr->next = NULL;
-      list_insert(curr, (control->lh[i].blk));
-      break;
-    }
+  l = lists_of(heap, ptr);
+  release_block(heap, ptr, &l[class_of(l, size)]);
+}
+
+static void
+p2fl_free_unsized(kma_heap_t *heap, void* ptr)
+{
+  kma_page_t *page;
+
+  /* runs of pages carry no class. */
+  page = page_of(ptr);
+  if(page->tag < 0) {
+    heap_free_pages(heap, page);
+    return;
   }
 
-  control->free++;
+  release_block(heap, ptr, &lists_of(heap, ptr)[page->tag - 1]);
+}
+
+static kma_size_t
+p2fl_usable_size(kma_heap_t *heap, void* ptr)
+{
+  kma_page_t *page;
+
+  /* runs of pages carry no class. */
+  page = page_of(ptr);
+  if(page->tag < 0)
+    return page->size;
+
+  /* classes are looked up by their available size, so only that much
+   * frees into the same class again. */
+  return lists_of(heap, ptr)[page->tag - 1].avai_size;
+}
+
+static kma_size_t
+p2fl_good_size(kma_heap_t *heap, kma_size_t size)
+{
+  kma_size_t blkSize;
 
-  /* free all the page when request memory number = free memory number. */
-  if(control->used == control->free) {
-    curr = control->page_list.blk->next;
-    while(curr->next != NULL) {
-      temp = curr->next;
-      free_page((kma_page_t*)curr);
-      curr = temp;
+  if(size > PAGESIZE - sizeof(struct page_header))
+    return NUMPAGES(size) * PAGESIZE;
+
+  for(blkSize = MINBLKSIZE; size > blkSize - sizeof(struct free_block); blkSize *= 2)
+    ;
+  return blkSize - sizeof(struct free_block);
+}
+
+static void
+p2fl_malloc_batch(kma_heap_t *heap, kma_size_t size, int n, void* ptrs[])
+{
+  struct p2fl_controller *control;
+  struct list_header *l;
+  struct free_block *curr;
+  int i=0, j=0;
+
+  if(size > PAGESIZE - sizeof(struct page_header)) {
+    for(j=0; j<n; j++)
+      ptrs[j] = p2fl_malloc(heap, size);
+    return;
+  }
+  if(heap->entry == NULL)
+    init_page_entry(heap);
+
+  control = plfl_info(heap);
+  i = class_of(control->lh, size);
+  l = &control->lh[i];
+
+  /* pop the blocks off the list in one pass, cutting new pages as the
+   * list runs dry. */
+  curr = l->blk->next;
+  for(j=0; j<n; j++) {
+    if(curr == NULL) {
+      l->blk->next = NULL;
+      new_free_block(heap, l);
+      curr = l->blk->next;
     }
+    ptrs[j] = curr;
+    curr = curr->next;
+  }
+  l->blk->next = curr;
+  control->used += n;
+}
+
+static void
+p2fl_free_batch(kma_heap_t *heap, kma_size_t size, int n, void* ptrs[])
+{
+  struct p2fl_controller *control;
+  struct free_block *curr;
+  int i=0, j=0;
 
-    free_page((kma_page_t*)curr);
+  if(size > PAGESIZE - sizeof(struct page_header)) {
+    for(j=0; j<n; j++)
+      heap_free_pages(heap, page_of(ptrs[j]));
+    return;
+  }
+
+  control = plfl_info(heap);
+  i = class_of(control->lh, size);
+
+  for(j=0; j<n; j++) {
+    curr = ptrs[j];
+    curr->next = NULL;
+    list_insert(curr, control->lh[i].blk);
+  }
+  control->free += n;
+  release_pages(heap);
+}
+
+static void*
+p2fl_memalign(kma_heap_t *heap, kma_size_t alignment, kma_size_t size)
+{
+  struct p2fl_controller *control;
+  struct free_block *ptr;
+  int i=0;
+
+  if(alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment > PAGESIZE)
+    return NULL;
+  if(size < alignment)
+    size = alignment;
+  /* runs start a page. */
+  if(size > PAGESIZE - sizeof(struct page_header)
+     || alignment <= sizeof(struct page_header))
+    return p2fl_malloc(heap, size);
+  if(heap->entry == NULL)
+    init_page_entry(heap);
+
+  control = plfl_info(heap);
+  i = class_of(control->al, size);
+  if(control->al[i].blk->next == NULL)
+    new_aligned_block(heap, i);
+  ptr = control->al[i].blk->next;
+  control->al[i].blk->next = ptr->next;
+
+  control->used++;
+  return ptr;
+}
+
+static void*
+p2fl_realloc(kma_heap_t *heap, void* ptr, kma_size_t old, kma_size_t size)
+{
+  struct list_header *l;
+  void *res;
+
+  if(ptr == NULL)
+    return p2fl_malloc(heap, size);
+  if(size == 0) {
+    p2fl_free(heap, ptr, old);
+    return NULL;
+  }
+
+  if(old > PAGESIZE - sizeof(struct page_header)) {
+    if(size > PAGESIZE - sizeof(struct page_header) && size <= page_of(ptr)->size)
+      return ptr;
+  }
+  else if(size <= PAGESIZE - sizeof(struct page_header)) {
+    l = lists_of(heap, ptr);
+    if(class_of(l, old) == class_of(l, size))
+      return ptr;
+  }
 
-    free_page(page_entry);
-    page_entry = NULL;
-  } 
+  res = p2fl_malloc(heap, size);
+  if(res != NULL) {
+    memcpy(res, ptr, old < size ? old : size);
+    p2fl_free(heap, ptr, old);
+  }
+  return res;
+}
+
+static void
+p2fl_destroy(kma_heap_t *heap)
+{
+  struct p2fl_controller *control;
 
+  heap_free_runs(heap);
+  if(heap->entry == NULL)
+    return;
 
+  control = plfl_info(heap);
+  control->free = control->used;
+  release_pages(heap);
 }
 
-#endif // KMA_P2FL
+kma_ops_t kma_p2fl_ops =
+  {
+    .name         = "p2fl",
+    .malloc       = p2fl_malloc,
+    .free         = p2fl_free,
+    .free_unsized = p2fl_free_unsized,
+    .realloc      = p2fl_realloc,
+    .memalign     = p2fl_memalign,
+    .usable_size  = p2fl_usable_size,
+    .good_size    = p2fl_good_size,
+    .malloc_batch = p2fl_malloc_batch,
+    .free_batch   = p2fl_free_batch,
+    .destroy      = p2fl_destroy
+  };
@@ -31,13 +31,13 @@
  *    - initial version for the kernel memory allocator project
  *
  ***************************************************************************/
-#ifdef KMA_RM
 #define __KMA_IMPL__
 
 /************System include***********************************************/
 #include <assert.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -50,53 +50,91 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+/* tag of the pages blocks are carved from, runs have negative tags. */
+#define DATA_PAGE 1
+/* free pieces of 2^k to 2^(k+1)-1 bytes are kept on free list k. */
+#define FREELISTS 14
+
+/* blocks take whole GRANULE steps, which leaves the low bits of their
+ * size for flags. IN_USE tells a block from a free piece, whose first
+ * word is its node. PREV_FREE marks a block behind a free piece, whose
+ * last word is its node. */
+#define GRANULE 8
+#define IN_USE 1
+#define PREV_FREE 2
+#define BLOCKSIZE(blk) ((blk)->size & ~(kma_size_t)(GRANULE - 1))
+#define BLOCKBYTES(size) \
+  (((size) + sizeof(struct block_header) + GRANULE - 1) & ~(kma_size_t)(GRANULE - 1))
+
+/* how a free piece is picked for a request, KMA_RM_FIT=instant, first
+ * or best selects one. instant fit takes the head of the first list
+ * whose pieces are all large enough. first fit takes the first piece
+ * that fits, from the list the size falls into on. best fit, the
+ * default, takes the smallest piece that fits. */
+#define INSTANT_FIT 0
+#define FIRST_FIT 1
+#define BEST_FIT 2
+
 /************Global Variables*********************************************/
 
-static kma_page_t *page_entry = NULL;
 
 /************Function Prototypes******************************************/
 
-void *allocate_mem(kma_size_t);
-void newPage_of_node(); 
+static struct block_header *allocate_mem(kma_heap_t *heap, kma_size_t, kma_size_t);
+static void release_mem(kma_heap_t *heap, void*, kma_size_t);
+static void release_pages(kma_heap_t *heap);
+static void newPage_of_node(kma_heap_t *heap, kma_page_t*); 
 
 /************External Declaration*****************************************/
 
 /**************Implementation***********************************************/
+/* pages blocks are carved from also keep their node of the data list. */
 struct page_header {
   kma_page_t *page;
+  struct node *data;
+};
+
+/* every block carries its size and flags in front, so that it can be
+ * freed without it. */
+struct block_header {
+  kma_size_t size;
 };
 
 struct node {
   void *addr;
-  int size;
+  kma_size_t size;
   struct node *prev;
   struct node *next;
 };
 
+/* a bit of nonempty is set while free list k holds pieces. */
 struct rm_controller {
   int   used;
   int   free;
-  struct node free_mem_list;
+  int   fit;
+  unsigned long nonempty;
+  struct node freelist[FREELISTS];
   struct node available_node_list;
   struct node page_list;
+  struct node data_list;
 };
 
-void *current_page_begin_addr(void *addr) {
+static void *current_page_begin_addr(void *addr) {
   return (void*)((unsigned long)addr & ~((unsigned long)(PAGESIZE-1)));
 }
 
-void *current_page_end_addr(void *addr) {
+static void *current_page_end_addr(void *addr) {
   return (void*)((char*)current_page_begin_addr(addr) + PAGESIZE);
 }
 
-void list_append(struct node *newNode, struct node *list) {
+static void list_append(struct node *newNode, struct node *list) {
   newNode->prev = list->prev;
   newNode->next = list;
   list->prev = newNode;
   newNode->prev->next = newNode;
 }
 
-void list_insert(struct node *newNode, struct node *list, int pos) {
+static void list_insert(struct node *newNode, struct node *list, int pos) {
   if(pos < 1)
     fprintf(stderr, "insert position is less than 1");
   else {
@@ -120,31 +158,118 @@ void list_insert(struct node *newNode, struct node *list, int pos) {
   }
 }
 
-void list_remove(struct node *node) {
+static void list_remove(struct node *node) {
   node->prev->next = node->next;
   node->next->prev = node->prev;
 }
 
-void init_page_entry() {
+/* the free list of pieces of size bytes. */
+static int freelist_of(kma_size_t size) {
+  return 8 * sizeof(long) - 1 - __builtin_clzl(size);
+}
+
+/* the block or free piece behind the memory at addr, NULL at the end
+ * of the page. */
+static struct block_header *next_block(void *addr, kma_size_t size) {
+  char *end = (char*)addr + size;
+
+  if(end == (char*)current_page_end_addr(addr))
+    return NULL;
+  return (struct block_header*)end;
+}
+
+/* the free piece right behind the memory at addr, or NULL. */
+static struct node *next_piece(void *addr, kma_size_t size) {
+  struct block_header *blk = next_block(addr, size);
+
+  if(blk == NULL || (blk->size & IN_USE) != 0)
+    return NULL;
+  return *(struct node**)blk;
+}
+
+/* the free piece right in front of a block, or NULL. */
+static struct node *prev_piece(struct block_header *blk) {
+  if((blk->size & PREV_FREE) == 0)
+    return NULL;
+  return *((struct node**)blk - 1);
+}
+
+/* a free piece holds its node at both ends, and the block behind it
+ * is flagged, so a block freed next to it finds it right away. */
+static void piece_tag(struct node *node) {
+  struct block_header *after;
+
+  *(struct node**)node->addr = node;
+  *((struct node**)((char*)node->addr + node->size) - 1) = node;
+  after = next_block(node->addr, node->size);
+  if(after != NULL)
+    after->size |= PREV_FREE;
+}
+
+static void piece_insert(struct rm_controller *rm, struct node *node) {
+  int k = freelist_of(node->size);
+
+  list_insert(node, &(rm->freelist[k]), 1);
+  rm->nonempty |= 1UL << k;
+  piece_tag(node);
+}
+
+static void piece_remove(struct rm_controller *rm, struct node *node) {
+  int k = freelist_of(node->size);
+
+  list_remove(node);
+  if(rm->freelist[k].next == &(rm->freelist[k]))
+    rm->nonempty &= ~(1UL << k);
+}
+
+/* move a free piece, and over to another list if its size calls for it. */
+static void piece_update(struct rm_controller *rm, struct node *node, void *addr, kma_size_t size) {
+  if(freelist_of(size) != freelist_of(node->size)) {
+    piece_remove(rm, node);
+    node->addr = addr;
+    node->size = size;
+    piece_insert(rm, node);
+    return;
+  }
+  node->addr = addr;
+  node->size = size;
+  piece_tag(node);
+}
+
+static void init_page_entry(kma_heap_t *heap) {
   struct page_header *header;
   struct rm_controller *rm;
   struct node *curr, *end;
-  page_entry = get_page();
+  char *value;
+  int k;
+  heap->entry = get_page();
 
   /* allocate header and controller to entry page. */
-  header = (struct page_header*)page_entry->ptr;
-  rm = (struct rm_controller*)((char*)page_entry->ptr + sizeof(struct page_header));
+  header = (struct page_header*)heap->entry->ptr;
+  rm = (struct rm_controller*)((char*)heap->entry->ptr + sizeof(struct page_header));
 
   /* initial elements in header and controller */
-  header->page = page_entry;
+  header->page = heap->entry;
   rm->used = 0;
   rm->free = 0;
-  rm->free_mem_list.prev = &(rm->free_mem_list);
-  rm->free_mem_list.next = &(rm->free_mem_list);
+  rm->fit = BEST_FIT;
+  if((value = getenv("KMA_RM_FIT")) != NULL) {
+    if(strcmp(value, "instant") == 0)
+      rm->fit = INSTANT_FIT;
+    else if(strcmp(value, "first") == 0)
+      rm->fit = FIRST_FIT;
+  }
+  rm->nonempty = 0;
+  for(k=0; k<FREELISTS; k++) {
+    rm->freelist[k].prev = &(rm->freelist[k]);
+    rm->freelist[k].next = &(rm->freelist[k]);
+  }
   rm->available_node_list.prev = &(rm->available_node_list);
   rm->available_node_list.next = &(rm->available_node_list);
   rm->page_list.prev = &(rm->page_list);
   rm->page_list.next = &(rm->page_list);
+  rm->data_list.prev = &(rm->data_list);
+  rm->data_list.next = &(rm->data_list);
   
   curr = (struct node*)((char*)rm + sizeof(struct rm_controller));
   end = (struct node*)((char*)current_page_end_addr(curr));
@@ -156,36 +281,34 @@ void init_page_entry() {
   }
 }
 
-void *rm_info() {
+static void *rm_info(kma_heap_t *heap) {
   void *ptr;
-  ptr = (struct rm_controller*)((char*)page_entry->ptr + sizeof(struct page_header));
+  ptr = (struct rm_controller*)((char*)heap->entry->ptr + sizeof(struct page_header));
 
   return ptr;
 }
 
-struct node *find_available_node() {
+static struct node *find_available_node(kma_heap_t *heap) {
   struct rm_controller *rm;
   struct node *curr;
 
-  rm = rm_info();
+  rm = rm_info(heap);
 
   /* if there are no more available node */
   if(rm->available_node_list.next == &(rm->available_node_list)) {
-    newPage_of_node();
+    newPage_of_node(heap, get_page());
   }
   curr = rm->available_node_list.next;
 
   return curr;
 }
 
-void newPage_of_node() {
+static void newPage_of_node(kma_heap_t *heap, kma_page_t *page) {
   struct rm_controller *rm;
-  kma_page_t *page;
   struct page_header *header;
   struct node *curr, *end;
   
-  rm = rm_info();
-  page = get_page();
+  rm = rm_info(heap);
   header = (struct page_header*)page->ptr;
   header->page = page;
   curr = (struct node*)((char*)header + sizeof(struct page_header));
@@ -194,7 +317,7 @@ void newPage_of_node() {
     list_append(curr, &(rm->available_node_list));
     curr++;
   }
-  curr = find_available_node();
+  curr = find_available_node(heap);
   curr->addr = (void*)page;
   list_remove(curr);
   list_append(curr, &(rm->page_list));
@@ -206,152 +329,451 @@ void newPage_of_node() {
 
 
 
-void *allocate_mem(kma_size_t size) {
-  struct node *curr;
-  kma_page_t *page;
-  struct page_header *header;
-  struct rm_controller *rm = rm_info();
-  void *ptr;
-  int available = 0;
-  
-  /* find a free place to allocate request */
-  curr = rm->free_mem_list.next;
-  while(curr != &(rm->free_mem_list)) {
-    if(curr->size >= size) {
-      available = 1;
-      break;
+/* bytes to skip at addr for the memory behind a block header there to
+ * be aligned to align. */
+static int align_front(void *addr, kma_size_t align) {
+  return -((unsigned long)addr + sizeof(struct block_header)) & (align - 1);
+}
+
+/* a free piece with room for size bytes at an alignment of align behind
+ * the block header, and the bytes to skip at its front for that. */
+static struct node *find_piece(struct rm_controller *rm, kma_size_t size, kma_size_t align, int *front) {
+  struct node *curr, *best;
+  unsigned long lists;
+  int k;
+
+  /* pieces on list k and up all hold at least 2^k bytes, so with room
+   * for the padding any of them fits. only the lists below, where a
+   * piece may be too small, are left to search when they are empty. */
+  if(rm->fit == INSTANT_FIT) {
+    k = freelist_of(size + align - 1);
+    if(((size + align - 1) & (size + align - 2)) != 0)
+      k++;
+    lists = (k < FREELISTS) ? rm->nonempty & (~0UL << k) : 0;
+    if(lists != 0) {
+      curr = rm->freelist[__builtin_ctzl(lists)].next;
+      *front = align_front(curr->addr, align);
+      return curr;
     }
-    curr = curr->next;
   }
 
-  /* if no more free memory, 
-   * then create a new page to store.
-   */
-  if(available == 0) {
-    page = get_page();
+  /* pieces on later lists are all larger than those on earlier ones, so
+   * the smallest fitting piece of the first list with one is the best. */
+  lists = rm->nonempty & (~0UL << freelist_of(size));
+  while(lists != 0) {
+    k = __builtin_ctzl(lists);
+    best = NULL;
+    for(curr = rm->freelist[k].next; curr != &(rm->freelist[k]); curr = curr->next) {
+      if(curr->size >= align_front(curr->addr, align) + size
+         && (best == NULL || curr->size < best->size)) {
+        best = curr;
+        if(rm->fit != BEST_FIT)
+          break;
+      }
+    }
+    if(best != NULL) {
+      *front = align_front(best->addr, align);
+      return best;
+    }
+    lists &= lists - 1;
+  }
+  return NULL;
+}
+
+/* a block of size bytes, a GRANULE multiple. the memory behind its
+ * header is aligned to align, a power of two. */
+static struct block_header *allocate_mem(kma_heap_t *heap, kma_size_t size, kma_size_t align) {
+  struct node *curr, *tail;
+  struct block_header *blk, *after;
+  kma_page_t *page, *pages[2];
+  struct page_header *header;
+  struct rm_controller *rm = rm_info(heap);
+  kma_size_t rest;
+  int front = 0;
+
+  /* if no free piece fits, create a new page to store. */
+  curr = find_piece(rm, size, align, &front);
+  if(curr == NULL) {
+    /* out of nodes as well: take both pages in one go. */
+    if(rm->available_node_list.next == &(rm->available_node_list)) {
+      get_page_batch(2, pages);
+      page = pages[0];
+      newPage_of_node(heap, pages[1]);
+    }
+    else {
+      page = get_page();
+    }
+    page->tag = DATA_PAGE;
     header = (struct page_header*)page->ptr;
     header->page = page;
-    curr = find_available_node();
+    /* keep track of the page, blocks in use may fill it up. */
+    curr = find_available_node(heap);
+    curr->addr = (void*)page;
+    list_remove(curr);
+    list_append(curr, &(rm->data_list));
+    header->data = curr;
+    curr = find_available_node(heap);
+    list_remove(curr);
     curr->addr = (void*)((char*)page->ptr + sizeof(struct page_header));
     curr->size = page->size - sizeof(struct page_header);
+    piece_insert(rm, curr);
+    front = align_front(curr->addr, align);
   }
-    
-  /* allocate memeory and resize current node's address and size */
-  ptr = curr->addr;
-  curr->addr = (void*)((char*)curr->addr + size);
-  curr->size = curr->size - size;
-  if(curr->size == 0) {
-    if(available == 1)
-      list_remove(curr);
-    list_insert(curr, &(rm->available_node_list), 1);
+
+  /* carve the block. the memory in front of an aligned block stays a
+   * free piece, and so does the rest behind it. a piece used up whole
+   * goes back to the available nodes. */
+  blk = (struct block_header*)((char*)curr->addr + front);
+  rest = curr->size - front - size;
+  if(rest > 0) {
+    if(front > 0) {
+      tail = find_available_node(heap);
+      list_remove(tail);
+      tail->addr = (char*)blk + size;
+      tail->size = rest;
+      piece_insert(rm, tail);
+    }
+    else {
+      piece_update(rm, curr, (char*)blk + size, rest);
+    }
   }
   else {
-    if(available == 0) {
-      list_remove(curr);
-      list_append(curr, &(rm->free_mem_list));
+    after = next_block(blk, size);
+    if(after != NULL)
+      after->size &= ~(kma_size_t)PREV_FREE;
+    if(front == 0) {
+      piece_remove(rm, curr);
+      list_insert(curr, &(rm->available_node_list), 1);
     }
   }
+  if(front > 0)
+    piece_update(rm, curr, curr->addr, front);
+  blk->size = size | IN_USE | (front > 0 ? PREV_FREE : 0);
   rm->used++;
-  return ptr;
+  return blk;
 }
 
 
 
-void*
-kma_malloc(kma_size_t size)
+static void*
+rm_malloc(kma_heap_t *heap, kma_size_t size)
 {
-  if(size > PAGESIZE - sizeof(void*)) {
-      return NULL;
+  struct block_header *blk;
+  kma_page_t *page;
+
+  /* requests larger than a page get contiguous pages of their own */
+  if(size > PAGESIZE - sizeof(struct page_header) - sizeof(struct block_header)) {
+    page = heap_get_pages(heap, size);
+    return (page == NULL) ? NULL : page->ptr;
   }
 
-  if(page_entry == NULL)
-    init_page_entry(); 
+  if(heap->entry == NULL)
+    init_page_entry(heap); 
+
+  /* an empty block at the end of a page would point at the next page,
+   * and so look like a run. */
+  if(size == 0)
+    size = 1;
   
+  blk = allocate_mem(heap, BLOCKBYTES(size), 1);
 
-  return allocate_mem(size);
+  return blk + 1;
 }
 
-void
-kma_free(void* ptr, kma_size_t size)
+static void
+rm_free(kma_heap_t *heap, void* ptr, kma_size_t size)
 {
-  struct rm_controller *rm;
-  struct node *curr, *node;
-  struct page_header *header;
-  void* end_addr;
-//  kma_page_t pageFree[1000];
-  int combine = 0;
-  
-  rm = rm_info();
+  struct block_header *blk;
 
-  end_addr = (void*)((char*)ptr + size);
-  node = NULL;
+  /* blocks never start a page, the page header is in front of them. */
+  if(size > PAGESIZE - sizeof(struct page_header) - sizeof(struct block_header)
+     || ptr == current_page_begin_addr(ptr)) {
+    heap_free_pages(heap, page_of(ptr));
+    return;
+  }
 
-  // TODO verify the ptr and size validation.
-  
-  /* find if this memory piece is next to a free memory piece */
-  curr = rm->free_mem_list.next;
-  while(curr != &(rm->free_mem_list)) {
-    if(curr->addr == end_addr) {
-      if(combine == 0){
-        combine = 1;
-        curr->size = curr->size + size;
-        curr->addr = ptr;
-        node = curr;
-      }
-      else if(combine == 1){
-        curr->size = curr->size + node->size;
-        curr->addr = node->addr;
-        list_remove(node);
-        list_insert(node, &(rm->available_node_list), 1);
-        break;
-      }
-    }
-    else if(((char*)curr->addr + curr->size) == ptr) {
-      if(combine == 0) {
-        combine = 1;
-        curr->size = curr->size + size;
-        node = curr;
-      }
-      else if(combine == 1) {
-        curr->size = curr->size + node->size;
-        list_remove(node);
-        list_insert(node, &(rm->available_node_list), 1);
-        break;
-      }
+  blk = (struct block_header*)ptr - 1;
+  release_mem(heap, blk, BLOCKSIZE(blk));
+}
+
+static void
+rm_free_unsized(kma_heap_t *heap, void* ptr)
+{
+  struct block_header *blk;
+  kma_page_t *page;
+
+  /* runs of pages carry no block header. */
+  page = page_of(ptr);
+  if(page->tag < 0) {
+    heap_free_pages(heap, page);
+    return;
+  }
+
+  blk = (struct block_header*)ptr - 1;
+  release_mem(heap, blk, BLOCKSIZE(blk));
+}
+
+/* give back all pages when every block is freed. */
+static void release_pages(kma_heap_t *heap) {
+  struct rm_controller *rm;
+  struct node *curr, *next;
+  kma_page_t *batch[PAGEBATCH];
+  int n = 0;
+
+  rm = rm_info(heap);
+  if(rm->used != rm->free)
+    return;
+
+  /* remove all page which used for allocate request memory */
+  curr = rm->data_list.next;
+  while(curr != &(rm->data_list)) {
+    batch[n++] = curr->addr;
+    if(n == PAGEBATCH) {
+      free_page_batch(n, batch);
+      n = 0;
     }
-      
     curr = curr->next;
   }
+  free_page_batch(n, batch);
+  n = 0;
+  /* remove all page used for store node. the node may live in the
+   * page it describes, so step past it before the page goes away. */
+  curr = rm->page_list.next;
+  while(curr != &(rm->page_list)) {
+    next = curr->next;
+    batch[n++] = curr->addr;
+    if(n == PAGEBATCH) {
+      free_page_batch(n, batch);
+      n = 0;
+    }
+    curr = next;
+  }
 
-  if(combine == 0) {
-    node = find_available_node();
+  batch[n++] = heap->entry;
+  free_page_batch(n, batch);
+  heap->entry = NULL;
+}
+
+static void
+release_mem(kma_heap_t *heap, void* ptr, kma_size_t size)
+{
+  struct rm_controller *rm;
+  struct page_header *header;
+  struct node *prev, *next, *node;
+
+  rm = rm_info(heap);
+
+  /* merge the memory piece with the free pieces next to it, which the
+   * tags at its borders point out. */
+  prev = prev_piece(ptr);
+  next = next_piece(ptr, size);
+  if(prev != NULL && next != NULL) {
+    piece_remove(rm, next);
+    list_insert(next, &(rm->available_node_list), 1);
+    piece_update(rm, prev, prev->addr, prev->size + size + next->size);
+    node = prev;
+  }
+  else if(prev != NULL) {
+    piece_update(rm, prev, prev->addr, prev->size + size);
+    node = prev;
+  }
+  else if(next != NULL) {
+    piece_update(rm, next, ptr, next->size + size);
+    node = next;
+  }
+  else {
+    node = find_available_node(heap);
+    list_remove(node);
     node->addr = ptr;
     node->size = size;
-    list_remove(node);
-    list_insert(node, &(rm->free_mem_list), 1);
+    piece_insert(rm, node);
   }
   rm->free++;
+
+  /* a page with no block left in it is one free piece again, and goes
+   * back right away rather than with the last block of the heap. */
+  header = (struct page_header*)current_page_begin_addr(ptr);
+  if(node->addr == (void*)(header + 1)
+     && node->size == header->page->size - sizeof(struct page_header)) {
+    piece_remove(rm, node);
+    list_insert(node, &(rm->available_node_list), 1);
+    list_remove(header->data);
+    list_insert(header->data, &(rm->available_node_list), 1);
+    free_page(header->page);
+  }
   
-  if(rm->used == rm->free) {
-    /* remove all page which used for allocate request memory */
-    curr = rm->free_mem_list.next;
-    while(curr != &(rm->free_mem_list)) {
-      header = (struct page_header*)current_page_begin_addr(curr->addr);
-      free_page(header->page);
-      curr = curr->next;
-    }
-    /* remove all page used for store node */
-    curr = rm->page_list.next;
-    while(curr != &(rm->page_list)) {
-      free_page(curr->addr);
-      curr = curr->next;
+  release_pages(heap);
+}
+
+static kma_size_t
+rm_usable_size(kma_heap_t *heap, void* ptr)
+{
+  struct block_header *blk;
+  kma_page_t *page;
+
+  /* runs of pages carry no block header. */
+  page = page_of(ptr);
+  if(page->tag < 0)
+    return page->size;
+
+  blk = (struct block_header*)ptr - 1;
+  return BLOCKSIZE(blk) - sizeof(struct block_header);
+}
+
+/* blocks are carved in GRANULE steps. */
+static kma_size_t
+rm_good_size(kma_heap_t *heap, kma_size_t size)
+{
+  if(size > PAGESIZE - sizeof(struct page_header) - sizeof(struct block_header))
+    return NUMPAGES(size) * PAGESIZE;
+  return BLOCKBYTES(size) - sizeof(struct block_header);
+}
+
+/* blocks come from the free pieces one by one, so a batch
+ * is no cheaper than its blocks. */
+static void
+rm_malloc_batch(kma_heap_t *heap, kma_size_t size, int n, void* ptrs[])
+{
+  int j=0;
+
+  for(j=0; j<n; j++)
+    ptrs[j] = rm_malloc(heap, size);
+}
+
+static void
+rm_free_batch(kma_heap_t *heap, kma_size_t size, int n, void* ptrs[])
+{
+  int j=0;
+
+  for(j=0; j<n; j++)
+    rm_free(heap, ptrs[j], size);
+}
+
+static void*
+rm_memalign(kma_heap_t *heap, kma_size_t alignment, kma_size_t size)
+{
+  struct block_header *blk;
+  kma_page_t *page;
+  kma_size_t freed, padded;
+
+  if(alignment == 0 || (alignment & (alignment - 1)) != 0 || alignment > PAGESIZE)
+    return NULL;
+
+  /* a block that is freed as a run or would not fit into a new page
+   * behind the headers and its padding gets a run of pages, which
+   * starts a page. */
+  freed = size < alignment ? alignment : size;
+  padded = (sizeof(struct page_header) + sizeof(struct block_header) + alignment - 1)
+    & ~(alignment - 1);
+  if(freed > PAGESIZE - sizeof(struct page_header) - sizeof(struct block_header)
+     || padded - sizeof(struct block_header) + BLOCKBYTES(size) > PAGESIZE) {
+    page = heap_get_pages(heap, freed);
+    return (page == NULL) ? NULL : page->ptr;
+  }
+
+  if(heap->entry == NULL)
+    init_page_entry(heap);
+
+  if(size == 0)
+    size = 1;
+
+  blk = allocate_mem(heap, BLOCKBYTES(size), alignment);
+
+  return blk + 1;
+}
+
+static void*
+rm_realloc(kma_heap_t *heap, void* ptr, kma_size_t old, kma_size_t size)
+{
+  struct rm_controller *rm;
+  struct block_header *blk, *tail, *after;
+  struct node *next;
+  kma_size_t need, have;
+  void *res;
+
+  if(ptr == NULL)
+    return rm_malloc(heap, size);
+  if(size == 0) {
+    rm_free(heap, ptr, old);
+    return NULL;
+  }
+
+  if(old > PAGESIZE - sizeof(struct page_header) - sizeof(struct block_header)
+     || ptr == current_page_begin_addr(ptr)) {
+    if(size > PAGESIZE - sizeof(struct page_header) - sizeof(struct block_header)
+       && size <= page_of(ptr)->size)
+      return ptr;
+  }
+  else if(size <= PAGESIZE - sizeof(struct page_header) - sizeof(struct block_header)) {
+    rm = rm_info(heap);
+    blk = (struct block_header*)ptr - 1;
+    need = BLOCKBYTES(size);
+    have = BLOCKSIZE(blk);
+
+    /* shrink by handing the tail back, once it is big enough to be of
+     * use. the tail counts as a block of its own. */
+    if(need <= have) {
+      if(need + sizeof(struct block_header) < have) {
+        rm->used++;
+        tail = (struct block_header*)((char*)blk + need);
+        tail->size = (have - need) | IN_USE;
+        blk->size = need | (blk->size & (GRANULE - 1));
+        release_mem(heap, tail, have - need);
+      }
+      return ptr;
     }
 
-    free_page(page_entry);
-    page_entry = NULL;
+    /* grow into the free memory piece right behind the block. */
+    next = next_piece(blk, have);
+    if(next != NULL && next->size >= need - have) {
+      if(next->size == need - have) {
+        after = next_block(next->addr, next->size);
+        if(after != NULL)
+          after->size &= ~(kma_size_t)PREV_FREE;
+        piece_remove(rm, next);
+        list_insert(next, &(rm->available_node_list), 1);
+      }
+      else {
+        piece_update(rm, next, (char*)blk + need, next->size - (need - have));
+      }
+      blk->size = need | (blk->size & (GRANULE - 1));
+      return ptr;
+    }
+  }
 
+  res = rm_malloc(heap, size);
+  if(res != NULL) {
+    memcpy(res, ptr, old < size ? old : size);
+    rm_free(heap, ptr, old);
   }
+  return res;
 }
 
+static void
+rm_destroy(kma_heap_t *heap)
+{
+  struct rm_controller *rm;
+
+  heap_free_runs(heap);
+  if(heap->entry == NULL)
+    return;
+
+  rm = rm_info(heap);
+  rm->free = rm->used;
+  release_pages(heap);
+}
 
-#endif // KMA_RM
+kma_ops_t kma_rm_ops =
+  {
+    .name         = "rm",
+    .malloc       = rm_malloc,
+    .free         = rm_free,
+    .free_unsized = rm_free_unsized,
+    .realloc      = rm_realloc,
+    .memalign     = rm_memalign,
+    .usable_size  = rm_usable_size,
+    .good_size    = rm_good_size,
+    .malloc_batch = rm_malloc_batch,
+    .free_batch   = rm_free_batch,
+    .destroy      = rm_destroy
+  };
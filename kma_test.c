@@ -0,0 +1,695 @@
+/***************************************************************************
+ *  Title: Kernel Memory Allocator
+ * -------------------------------------------------------------------------
+ *    Purpose: Tests of the kma_*() interface on the allocator backend
+ *             KMA_ALLOCATOR selects, make test runs every backend
+ ***************************************************************************/
+#define __KMA_TEST_IMPL__
+
+/************System include***********************************************/
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+/************Private include**********************************************/
+#include "kma_page.h"
+#include "kma.h"
+
+/************Defines and Typedefs*****************************************/
+/*  #defines and typedefs should have their names in all caps.
+ *  Global variables begin with g. Global constants with k. Local
+ *  variables should be in all lower case. When initializing
+ *  structures and arrays, line everything up in neat columns.
+ */
+
+#define OBJECTS 1000
+#define BATCH 100
+
+#define ALIGNED 4096
+#define ALIGNSLACK 8
+
+#define HEAPS 8
+
+#define MANY 3000
+
+#define BUFFERS 64
+#define RESIZES 20000
+#define MAXRESIZE 70000
+
+#define NUMSIZES ((int) (sizeof(sizes) / sizeof(sizes[0])))
+
+/* a test fails through error(), and must have freed everything it
+ * allocated when it returns */
+typedef struct
+{
+  char* name;
+  void (*run)();
+} test_t;
+
+/************Function Prototypes******************************************/
+void test_free();
+void test_batch();
+void test_usable();
+void test_realloc();
+void test_zero();
+void test_calloc();
+void test_zeroed();
+void test_memalign();
+void test_heap();
+void test_many();
+void test_huge();
+void check_zero(void*, kma_size_t, char*);
+void fill(void*, kma_size_t, int);
+void check(void*, kma_size_t, int, char*);
+void usage();
+void error(char*, char*);
+
+/************Global Variables*********************************************/
+
+static test_t tests[] =
+  {
+    { "free",     test_free     },
+    { "batch",    test_batch    },
+    { "usable",   test_usable   },
+    { "realloc",  test_realloc  },
+    { "zero",     test_zero     },
+    { "calloc",   test_calloc   },
+    { "zeroed",   test_zeroed   },
+    { "memalign", test_memalign },
+    { "heap",     test_heap     },
+    { "many",     test_many     },
+    { "huge",     test_huge     },
+    { NULL,       NULL          }
+  };
+
+static char* name = NULL;
+
+/* sizes the tests run through, around the class boundaries of the
+ * backends and up to runs of pages */
+static kma_size_t sizes[] =
+  {
+    1, 8, 16, 24, 31, 32, 56, 64, 100, 128, 255, 256, 500, 1000, 1024,
+    2000, 4000, 4096, 8000, 8192, 8193, 20000, 65536, 300000
+  };
+
+/************External Declaration*****************************************/
+
+/**************Implementation***********************************************/
+
+int
+main(int argc, char* argv[])
+{
+  test_t* t;
+  kma_page_stat_t* stat;
+  int ran = 0;
+
+  name = argv[0];
+
+  printf("%s: Testing %s\n", name, kma_backend()->name);
+  for (t = tests; t->name != NULL; t++)
+    {
+      if (argc < 2 || strcmp(argv[1], t->name) == 0)
+	{
+	  t->run();
+	  stat = page_stats();
+	  if (stat->num_in_use != 0)
+	    {
+	      error("pages still in use after test", t->name);
+	    }
+	  printf("%-10s ok\n", t->name);
+	  ran = 1;
+	}
+    }
+
+  if (!ran)
+    {
+      usage();
+    }
+
+  printf("Test: PASS\n");
+  return 0;
+}
+
+void
+usage()
+{
+  test_t* t;
+
+  printf("Usage: %s [test]\n", name);
+  printf("Tests:");
+  for (t = tests; t->name != NULL; t++)
+    {
+      printf(" %s", t->name);
+    }
+  printf("\n");
+  exit(0);
+}
+
+void
+error(char* message, char* arg)
+{
+  fprintf(stderr, "ERROR: %s: %s.\n", message, arg);
+  printf("Test: FAILED\n");
+  exit(-1);
+}
+
+/* fills memory with a pattern that differs from object to object */
+void
+fill(void* ptr, kma_size_t size, int seed)
+{
+  unsigned char* p = ptr;
+  kma_size_t i;
+
+  for (i = 0; i < size; i++)
+    {
+      p[i] = (unsigned char) (seed * 31 + i);
+    }
+}
+
+void
+check(void* ptr, kma_size_t size, int seed, char* test)
+{
+  unsigned char* p = ptr;
+  kma_size_t i;
+
+  for (i = 0; i < size; i++)
+    {
+      if (p[i] != (unsigned char) (seed * 31 + i))
+	{
+	  error("memory mismatch", test);
+	}
+    }
+}
+
+void
+check_zero(void* ptr, kma_size_t size, char* test)
+{
+  unsigned char* p = ptr;
+  kma_size_t i;
+
+  for (i = 0; i < size; i++)
+    {
+      if (p[i] != 0)
+	{
+	  error("memory not zeroed", test);
+	}
+    }
+}
+
+/* objects of every size, freed with and without their size while their
+ * neighbours are still in use */
+void
+test_free()
+{
+  void* ptrs[OBJECTS];
+  int i;
+
+  for (i = 0; i < OBJECTS; i++)
+    {
+      ptrs[i] = kma_malloc(sizes[i % NUMSIZES]);
+      if (ptrs[i] == NULL)
+	{
+	  error("got NULL from kma_malloc", "free");
+	}
+      fill(ptrs[i], sizes[i % NUMSIZES], i);
+    }
+
+  for (i = 0; i < OBJECTS; i += 2)
+    {
+      check(ptrs[i], sizes[i % NUMSIZES], i, "free");
+      kma_free(ptrs[i], sizes[i % NUMSIZES]);
+    }
+  for (i = OBJECTS - 1; i > 0; i -= 2)
+    {
+      check(ptrs[i], sizes[i % NUMSIZES], i, "free");
+      kma_free_unsized(ptrs[i]);
+    }
+}
+
+/* two batches of every size, the first one freed while the second one
+ * is still in use */
+void
+test_batch()
+{
+  void* first[BATCH];
+  void* second[BATCH];
+  int i, j;
+
+  for (i = 0; i < NUMSIZES; i++)
+    {
+      kma_malloc_batch(sizes[i], BATCH, first);
+      kma_malloc_batch(sizes[i], BATCH, second);
+      for (j = 0; j < BATCH; j++)
+	{
+	  if (first[j] == NULL || second[j] == NULL)
+	    {
+	      error("got NULL from kma_malloc_batch", "batch");
+	    }
+	  fill(first[j], sizes[i], j);
+	  fill(second[j], sizes[i], BATCH + j);
+	}
+
+      for (j = 0; j < BATCH; j++)
+	{
+	  check(first[j], sizes[i], j, "batch");
+	}
+      kma_free_batch(sizes[i], BATCH, first);
+      for (j = 0; j < BATCH; j++)
+	{
+	  check(second[j], sizes[i], BATCH + j, "batch");
+	}
+      kma_free_batch(sizes[i], BATCH, second);
+    }
+}
+
+/* objects are filled up to their usable size, which is what good_size
+ * promised, and freed as that size */
+void
+test_usable()
+{
+  void* ptrs[OBJECTS];
+  kma_size_t usable[OBJECTS];
+  kma_size_t size;
+  int i;
+
+  for (i = 0; i < OBJECTS; i++)
+    {
+      size = sizes[i % NUMSIZES];
+      ptrs[i] = kma_malloc(size);
+      if (ptrs[i] == NULL)
+	{
+	  error("got NULL from kma_malloc", "usable");
+	}
+      usable[i] = kma_usable_size(ptrs[i]);
+      if (usable[i] < size || usable[i] != kma_good_size(size))
+	{
+	  error("usable size differs from the good size", "usable");
+	}
+      fill(ptrs[i], usable[i], i);
+    }
+
+  for (i = 0; i < OBJECTS; i++)
+    {
+      check(ptrs[i], usable[i], i, "usable");
+      kma_free(ptrs[i], usable[i]);
+    }
+}
+
+/* buffers grown and shrunk to random sizes, small steps and large
+ * ones, keeping their contents up to the smaller size. a size of 0
+ * frees a buffer and a NULL buffer is allocated */
+void
+test_realloc()
+{
+  void* ptrs[BUFFERS];
+  kma_size_t size[BUFFERS];
+  int seed[BUFFERS];
+  kma_size_t new;
+  int i, j;
+
+  memset(ptrs, 0, sizeof(ptrs));
+  memset(size, 0, sizeof(size));
+  srand(1);
+  for (i = 0; i < RESIZES; i++)
+    {
+      j = rand() % BUFFERS;
+      switch (rand() % 4)
+	{
+	case 0:
+	  new = size[j] + 1 + rand() % 64;
+	  break;
+	case 1:
+	  new = size[j] / 2;
+	  break;
+	case 2:
+	  new = sizes[rand() % NUMSIZES];
+	  break;
+	default:
+	  new = rand() % MAXRESIZE;
+	  break;
+	}
+      if (ptrs[j] == NULL && new == 0)
+	{
+	  continue;
+	}
+
+      ptrs[j] = kma_realloc(ptrs[j], size[j], new);
+      if (new == 0)
+	{
+	  if (ptrs[j] != NULL)
+	    {
+	      error("kma_realloc to 0 bytes did not free", "realloc");
+	    }
+	}
+      else
+	{
+	  if (ptrs[j] == NULL)
+	    {
+	      error("got NULL from kma_realloc", "realloc");
+	    }
+	  check(ptrs[j], size[j] < new ? size[j] : new, seed[j], "realloc");
+	  seed[j] = i;
+	  fill(ptrs[j], new, i);
+	}
+      size[j] = new;
+    }
+
+  for (j = 0; j < BUFFERS; j++)
+    {
+      if (ptrs[j] != NULL)
+	{
+	  check(ptrs[j], size[j], seed[j], "realloc");
+	  kma_free(ptrs[j], size[j]);
+	}
+    }
+}
+
+/* requests of 0 bytes get memory that can be freed and resized like
+ * any other */
+void
+test_zero()
+{
+  void* ptrs[BATCH];
+  void* ptr;
+  int j;
+
+  for (j = 0; j < BATCH; j++)
+    {
+      ptrs[j] = kma_malloc(0);
+      if (ptrs[j] == NULL)
+	{
+	  error("got NULL from kma_malloc", "zero");
+	}
+    }
+  for (j = 0; j < BATCH; j += 2)
+    {
+      kma_free(ptrs[j], 0);
+    }
+  for (j = 1; j < BATCH; j += 2)
+    {
+      kma_free_unsized(ptrs[j]);
+    }
+
+  kma_malloc_batch(0, BATCH, ptrs);
+  kma_free_batch(0, BATCH, ptrs);
+
+  ptr = kma_calloc(0, 16);
+  if (ptr == NULL)
+    {
+      error("got NULL from kma_calloc", "zero");
+    }
+  kma_free(ptr, 0);
+  ptr = kma_calloc(16, 0);
+  if (ptr == NULL)
+    {
+      error("got NULL from kma_calloc", "zero");
+    }
+  kma_free_unsized(ptr);
+
+  ptr = kma_realloc(NULL, 0, 0);
+  if (ptr == NULL)
+    {
+      error("got NULL from kma_realloc", "zero");
+    }
+  ptr = kma_realloc(ptr, 0, 100);
+  if (ptr == NULL)
+    {
+      error("got NULL from kma_realloc", "zero");
+    }
+  fill(ptr, 100, 0);
+  check(ptr, 100, 0, "zero");
+  kma_free(ptr, 100);
+}
+
+/* zeroed objects of every size, in memory dirtied and freed by the
+ * round before. overflowing requests fail */
+void
+test_calloc()
+{
+  void* ptrs[OBJECTS];
+  kma_size_t size;
+  int round, i;
+
+  for (round = 0; round < 3; round++)
+    {
+      for (i = 0; i < OBJECTS; i++)
+	{
+	  size = sizes[(i + round) % NUMSIZES];
+	  ptrs[i] = kma_calloc(i % 2 ? 1 : size, i % 2 ? size : 1);
+	  if (ptrs[i] == NULL)
+	    {
+	      error("got NULL from kma_calloc", "calloc");
+	    }
+	  check_zero(ptrs[i], size, "calloc");
+	  fill(ptrs[i], size, i);
+	}
+      for (i = 0; i < OBJECTS; i++)
+	{
+	  size = sizes[(i + round) % NUMSIZES];
+	  check(ptrs[i], size, i, "calloc");
+	  kma_free(ptrs[i], size);
+	}
+    }
+
+  if (kma_calloc((kma_size_t) 1 << 40, (kma_size_t) 1 << 40) != NULL
+      || kma_calloc(3, ~(kma_size_t) 0 / 2) != NULL)
+    {
+      error("kma_calloc did not fail on overflow", "calloc");
+    }
+}
+
+/* runs of pages from get_zeroed_pages(), in pages dirtied and freed
+ * before, single pages through the page caches as well */
+void
+test_zeroed()
+{
+  kma_page_t* pages[BATCH];
+  int n, i;
+
+  for (n = 1; n <= 64; n *= 4)
+    {
+      for (i = 0; i < BATCH; i++)
+	{
+	  pages[i] = get_pages(n);
+	  memset(pages[i]->ptr, 0xa5, pages[i]->size);
+	}
+      for (i = 0; i < BATCH; i++)
+	{
+	  free_pages(pages[i]);
+	}
+      for (i = 0; i < BATCH; i++)
+	{
+	  pages[i] = get_zeroed_pages(n);
+	  if (pages[i]->size < n * PAGESIZE)
+	    {
+	      error("run too short", "zeroed");
+	    }
+	  check_zero(pages[i]->ptr, pages[i]->size, "zeroed");
+	  memset(pages[i]->ptr, 0x5a, pages[i]->size);
+	}
+      for (i = 0; i < BATCH; i++)
+	{
+	  free_pages(pages[i]);
+	}
+    }
+}
+
+/* objects of every alignment and size, freed as the larger of both
+ * and resized. backends that cut blocks aligned to their size need no
+ * more pages for them than the blocks fill, the dummy allocator gives
+ * every object pages of its own and RM puts a header in front of it */
+void
+test_memalign()
+{
+  void* ptrs[ALIGNED];
+  kma_size_t alignment, size;
+  int i, j;
+
+  for (alignment = 1; alignment <= PAGESIZE; alignment *= 2)
+    {
+      for (i = 0; i < OBJECTS; i++)
+	{
+	  size = sizes[i % NUMSIZES];
+	  ptrs[i] = kma_memalign(alignment, size);
+	  if (ptrs[i] == NULL || (unsigned long) ptrs[i] % alignment != 0)
+	    {
+	      error("kma_memalign did not align", "memalign");
+	    }
+	  if (kma_usable_size(ptrs[i]) < size)
+	    {
+	      error("usable size below the request", "memalign");
+	    }
+	  fill(ptrs[i], size, i);
+	}
+      for (i = 0; i < OBJECTS; i++)
+	{
+	  size = sizes[i % NUMSIZES];
+	  check(ptrs[i], size, i, "memalign");
+	  if (i % 3 == 0)
+	    {
+	      kma_free(ptrs[i], size < alignment ? alignment : size);
+	    }
+	  else if (i % 3 == 1)
+	    {
+	      kma_free_unsized(ptrs[i]);
+	    }
+	  else
+	    {
+	      ptrs[i] = kma_realloc(ptrs[i], size < alignment ? alignment : size, size + 100);
+	      check(ptrs[i], size, i, "memalign");
+	      kma_free(ptrs[i], size + 100);
+	    }
+	}
+    }
+
+  if (kma_memalign(3, 16) != NULL || kma_memalign(2 * PAGESIZE, 16) != NULL)
+    {
+      error("kma_memalign took an unsupported alignment", "memalign");
+    }
+
+  if (strcmp(kma_backend()->name, "dummy") == 0
+      || strcmp(kma_backend()->name, "rm") == 0)
+    {
+      return;
+    }
+  for (j = 0; j < ALIGNED; j++)
+    {
+      ptrs[j] = kma_memalign(64, 64);
+    }
+  if (page_stats()->num_in_use > ALIGNED * 64 / PAGESIZE + ALIGNSLACK)
+    {
+      error("aligned blocks take more pages than they fill", "memalign");
+    }
+  for (j = 0; j < ALIGNED; j++)
+    {
+      kma_free(ptrs[j], 64);
+    }
+}
+
+/* heaps of every backend side by side, each holding objects of every
+ * size. they keep to themselves, and destroying a heap gives back its
+ * pages with half of its objects still in use */
+void
+test_heap()
+{
+  kma_heap_t* heaps[HEAPS];
+  void* ptrs[HEAPS][OBJECTS / HEAPS];
+  kma_size_t size;
+  int backends, h, i;
+
+  for (backends = 0; kma_backends[backends] != NULL; backends++)
+    ;
+  for (h = 0; h < HEAPS; h++)
+    {
+      heaps[h] = kma_heap_create(kma_backends[h % backends]->name);
+      if (heaps[h] == NULL)
+	{
+	  error("got NULL from kma_heap_create", kma_backends[h % backends]->name);
+	}
+    }
+  if (kma_heap_create("none") != NULL)
+    {
+      error("kma_heap_create took an unknown backend", "heap");
+    }
+
+  for (i = 0; i < OBJECTS / HEAPS; i++)
+    {
+      for (h = 0; h < HEAPS; h++)
+	{
+	  size = sizes[(h + i) % NUMSIZES];
+	  ptrs[h][i] = (i % 2) ? kma_heap_calloc(heaps[h], 1, size)
+	    : kma_heap_malloc(heaps[h], size);
+	  if (ptrs[h][i] == NULL)
+	    {
+	      error("got NULL from a heap", heaps[h]->ops->name);
+	    }
+	  fill(ptrs[h][i], size, h * OBJECTS + i);
+	}
+    }
+
+  for (h = 0; h < HEAPS; h++)
+    {
+      for (i = 0; i < OBJECTS / HEAPS; i++)
+	{
+	  size = sizes[(h + i) % NUMSIZES];
+	  check(ptrs[h][i], size, h * OBJECTS + i, "heap");
+	  if (i % 2)
+	    {
+	      kma_heap_free(heaps[h], ptrs[h][i], size);
+	    }
+	}
+      kma_heap_destroy(heaps[h]);
+    }
+}
+
+/* more pages of blocks than any fixed table of pages a backend could
+ * keep, one page-sized block and one small block at a time */
+void
+test_many()
+{
+  static void* ptrs[MANY];
+  static void* small[MANY];
+  int i;
+
+  for (i = 0; i < MANY; i++)
+    {
+      ptrs[i] = kma_malloc(PAGESIZE);
+      small[i] = kma_malloc(100);
+      if (ptrs[i] == NULL || small[i] == NULL)
+	{
+	  error("got NULL from kma_malloc", "many");
+	}
+      fill(ptrs[i], PAGESIZE, i);
+      fill(small[i], 100, MANY + i);
+    }
+
+  for (i = 0; i < MANY; i++)
+    {
+      check(ptrs[i], PAGESIZE, i, "many");
+      check(small[i], 100, MANY + i, "many");
+      if (i % 2)
+	{
+	  kma_free(ptrs[i], PAGESIZE);
+	  kma_free(small[i], 100);
+	}
+      else
+	{
+	  kma_free_unsized(ptrs[i]);
+	  kma_free_unsized(small[i]);
+	}
+    }
+}
+
+/* requests of more pages than an int counts, or whose page count
+ * wraps around, fail instead of getting a run of the truncated count.
+ * a block that cannot grow stays as it was */
+void
+test_huge()
+{
+  kma_size_t huge[] = { ((kma_size_t) 1 << 45) + 1, ~(kma_size_t) 0 - 1 };
+  kma_size_t blocks[] = { 100, 3 * PAGESIZE };
+  void* ptr;
+  int i, j;
+
+  for (i = 0; i < sizeof(huge) / sizeof(huge[0]); i++)
+    {
+      if (kma_malloc(huge[i]) != NULL
+	  || kma_calloc(1, huge[i]) != NULL
+	  || kma_memalign(64, huge[i]) != NULL)
+	{
+	  error("got a block for a huge request", "huge");
+	}
+
+      for (j = 0; j < sizeof(blocks) / sizeof(blocks[0]); j++)
+	{
+	  ptr = kma_malloc(blocks[j]);
+	  fill(ptr, blocks[j], i);
+	  if (kma_realloc(ptr, blocks[j], huge[i]) != NULL)
+	    {
+	      error("kma_realloc grew a block to a huge size", "huge");
+	    }
+	  check(ptr, blocks[j], i, "huge");
+	  kma_free(ptr, blocks[j]);
+	}
+    }
+}
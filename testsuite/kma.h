@@ -42,8 +42,10 @@
 #define __KMA_H__
 
 /************System include***********************************************/
+#include <stddef.h>
 
 /************Private include**********************************************/
+#include "kma_page.h"
 
 /************Defines and Typedefs*****************************************/
 /*  #defines and typedefs should have their names in all caps.
@@ -63,10 +65,55 @@
 #define EXTERN extern
 #endif
 
-typedef int kma_size_t;
+typedef size_t kma_size_t;
+
+typedef struct kma_heap kma_heap_t;
+
+/* an allocator backend, every member but the name and destroy does
+ * what the function of the same name below does, in the heap it is
+ * given. realloc keeps a run of pages where it is while the request
+ * still needs a run and fits into it */
+typedef struct
+{
+  char* name;
+  void* (*malloc)(kma_heap_t*, kma_size_t size);
+  void (*free)(kma_heap_t*, void*, kma_size_t size);
+  void (*free_unsized)(kma_heap_t*, void*);
+  void* (*realloc)(kma_heap_t*, void*, kma_size_t old, kma_size_t size);
+  void* (*memalign)(kma_heap_t*, kma_size_t alignment, kma_size_t size);
+  kma_size_t (*usable_size)(kma_heap_t*, void*);
+  kma_size_t (*good_size)(kma_heap_t*, kma_size_t size);
+  void (*malloc_batch)(kma_heap_t*, kma_size_t size, int n, void* ptrs[]);
+  void (*free_batch)(kma_heap_t*, kma_size_t size, int n, void* ptrs[]);
+  void (*destroy)(kma_heap_t*);  // gives back every page, blocks in use or not
+} kma_ops_t;
+
+/* an allocator instance. the backend keeps all its state in the
+ * controller page it hangs off entry and the runs of pages it hands
+ * out in the table of runs, so heaps share nothing but the page
+ * allocator */
+struct kma_heap
+{
+  kma_ops_t* ops;
+  kma_page_t* entry;      // controller page, NULL while the heap is empty
+  kma_page_t* runs;       // table of the runs handed out, NULL while none is
+  int num_runs;           // runs in the table
+  bool zeroed;            // the next run has to be zero-filled
+  struct kma_heap* next;  // next free heap structure of the slab
+};
 
 /************Global Variables*********************************************/
 
+/* the backends built in, one per kma_*.c file, and all of them in a
+ * NULL terminated array */
+extern kma_ops_t kma_dummy_ops;
+extern kma_ops_t kma_rm_ops;
+extern kma_ops_t kma_p2fl_ops;
+extern kma_ops_t kma_mck2_ops;
+extern kma_ops_t kma_bud_ops;
+extern kma_ops_t kma_lzbud_ops;
+extern kma_ops_t* kma_backends[];
+
 /************Function Prototypes******************************************/
 
 /***********************************************************************
@@ -91,6 +138,214 @@ EXTERN void* kma_malloc(kma_size_t size);
  ***********************************************************************/
 EXTERN void kma_free(void*, kma_size_t size);
 
+/***********************************************************************
+ *  Title: Frees kernel memory without its size
+ * ---------------------------------------------------------------------
+ *    Purpose: Frees the memory space pointed to by ptr, which must
+ *             have been returned by a previous call to kma_malloc().
+ *             the size is looked up from the metadata of the page
+ *             ptr points into
+ *    Input: the pointer to the memory space
+ *    Output: none
+ ***********************************************************************/
+EXTERN void kma_free_unsized(void*);
+
+/***********************************************************************
+ *  Title: Resizes kernel memory
+ * ---------------------------------------------------------------------
+ *    Purpose: Resizes the memory space pointed to by ptr, in place if
+ *             the allocator can, otherwise by moving it. the contents
+ *             up to the smaller of both sizes are kept. a NULL ptr
+ *             allocates, a new size of 0 frees
+ *    Input: the pointer to the memory space, its current size and
+ *           the new size
+ *    Output: the resized memory space, or NULL on failure or when
+ *            it was freed
+ ***********************************************************************/
+EXTERN void* kma_realloc(void*, kma_size_t old, kma_size_t size);
+
+/***********************************************************************
+ *  Title: Allocates zeroed kernel memory
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates an array of n elements of size bytes each,
+ *             cleared to zero
+ *    Input: the number of elements and the size of an element
+ *    Output: the allocated memory, or NULL on failure or if the
+ *            total size does not fit into a kma_size_t. it is freed
+ *            as n * size bytes
+ ***********************************************************************/
+EXTERN void* kma_calloc(kma_size_t n, kma_size_t size);
+
+/***********************************************************************
+ *  Title: Allocates aligned kernel memory
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates size bytes at an address that is a multiple
+ *             of alignment, without padding the request by alignment
+ *             where the allocator can help it
+ *    Input: the alignment, a power of two up to PAGESIZE, and the
+ *           size
+ *    Output: the allocated memory, or NULL on failure or if the
+ *            alignment is not supported. it is freed as the larger
+ *            of alignment and size bytes
+ ***********************************************************************/
+EXTERN void* kma_memalign(kma_size_t alignment, kma_size_t size);
+
+/***********************************************************************
+ *  Title: Usable size of kernel memory
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the number of bytes the memory space pointed to by
+ *             ptr can hold. the memory may be used up to that size,
+ *             and freed or resized as any size from the one it was
+ *             allocated with up to it
+ *    Input: the pointer to the memory space
+ *    Output: the usable size
+ ***********************************************************************/
+EXTERN kma_size_t kma_usable_size(void*);
+
+/***********************************************************************
+ *  Title: Good size for kernel memory
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the usable size of the memory kma_malloc() would
+ *             hand out for a request, so that callers can ask for all
+ *             of it right away
+ *    Input: the size of the request
+ *    Output: the size the allocator would carve for it
+ ***********************************************************************/
+EXTERN kma_size_t kma_good_size(kma_size_t size);
+
+/***********************************************************************
+ *  Title: Allocates a batch of kernel memory
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates n objects of the same size in one operation,
+ *             searching for their size class only once
+ *    Input: the size of an object, the number of objects and an
+ *           array to hold them
+ *    Output: none, the array holds n pointers
+ ***********************************************************************/
+EXTERN void kma_malloc_batch(kma_size_t size, int n, void* ptrs[]);
+
+/***********************************************************************
+ *  Title: Frees a batch of kernel memory
+ * ---------------------------------------------------------------------
+ *    Purpose: Frees n objects of the same size in one operation,
+ *             searching for their size class only once
+ *    Input: the size of an object, the number of objects and the
+ *           pointers returned by kma_malloc() or kma_malloc_batch()
+ *    Output: none
+ ***********************************************************************/
+EXTERN void kma_free_batch(kma_size_t size, int n, void* ptrs[]);
+
+/***********************************************************************
+ *  Title: Selects the allocator backend
+ * ---------------------------------------------------------------------
+ *    Purpose: Selects the backend the functions above call into. until
+ *             then they use the one named by the KMA_ALLOCATOR
+ *             environment variable, or else the one the binary was
+ *             built for with -DKMA_RM, -DKMA_BUD and so on. memory must
+ *             be freed by the backend that allocated it, so the backend
+ *             only changes while none is allocated
+ *    Input: the name of the backend, with or without the KMA_ prefix
+ *           and in any case
+ *    Output: TRUE if the backend is in use now, FALSE if there is no
+ *            backend of that name or memory of another one is still
+ *            allocated
+ ***********************************************************************/
+EXTERN bool kma_select(char* name);
+
+/***********************************************************************
+ *  Title: Current allocator backend
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the backend the functions above call into
+ *    Input: none
+ *    Output: the backend
+ ***********************************************************************/
+EXTERN kma_ops_t* kma_backend();
+
+/***********************************************************************
+ *  Title: Creates a heap
+ * ---------------------------------------------------------------------
+ *    Purpose: Creates an allocator instance of its own, independent of
+ *             the one the functions above use and of all other heaps
+ *    Input: the name of the backend as for kma_select(), or NULL for
+ *           the selected one
+ *    Output: the heap, or NULL if there is no backend of that name
+ ***********************************************************************/
+EXTERN kma_heap_t* kma_heap_create(char* name);
+
+/***********************************************************************
+ *  Title: Destroys a heap
+ * ---------------------------------------------------------------------
+ *    Purpose: Gives back all pages of a heap at once, including those
+ *             of memory still allocated from it
+ *    Input: the heap
+ *    Output: none
+ ***********************************************************************/
+EXTERN void kma_heap_destroy(kma_heap_t*);
+
+/***********************************************************************
+ *  Title: Allocates memory from a heap
+ * ---------------------------------------------------------------------
+ *    Purpose: kma_malloc() in a heap, the other functions are called
+ *             the same way through the ops of the heap
+ *    Input: the heap and the size
+ *    Output: the allocated memory or NULL on failure
+ ***********************************************************************/
+EXTERN void* kma_heap_malloc(kma_heap_t*, kma_size_t size);
+
+/***********************************************************************
+ *  Title: Frees memory of a heap
+ * ---------------------------------------------------------------------
+ *    Purpose: kma_free() in a heap
+ *    Input: the heap, the pointer to the memory space and its size
+ *    Output: none
+ ***********************************************************************/
+EXTERN void kma_heap_free(kma_heap_t*, void*, kma_size_t size);
+
+/***********************************************************************
+ *  Title: Allocates zeroed memory from a heap
+ * ---------------------------------------------------------------------
+ *    Purpose: kma_calloc() in a heap
+ *    Input: the heap, the number of elements and the size of an
+ *           element
+ *    Output: the allocated memory or NULL on failure
+ ***********************************************************************/
+EXTERN void* kma_heap_calloc(kma_heap_t*, kma_size_t n, kma_size_t size);
+
+/***********************************************************************
+ *  Title: Allocates a run of pages in a heap
+ * ---------------------------------------------------------------------
+ *    Purpose: get_pages() for the backends, the run goes into the
+ *             table of runs of the heap so that destroying the heap
+ *             gives it back. the tag of the run holds its place in the
+ *             table and is negative, which tells runs from the pages
+ *             backends tag themselves. the run is zero-filled as by
+ *             get_zeroed_pages() when the heap is set to zeroed, which
+ *             it is not afterwards
+ *    Input: the heap and the size of the run in bytes
+ *    Output: the allocated run of memory pages, NULL when its number of
+ *            pages does not fit an int
+ ***********************************************************************/
+EXTERN kma_page_t* heap_get_pages(kma_heap_t*, kma_size_t size);
+
+/***********************************************************************
+ *  Title: Releases a run of pages of a heap
+ * ---------------------------------------------------------------------
+ *    Purpose: free_pages() for runs from heap_get_pages()
+ *    Input: the heap and the run of pages
+ *    Output: none
+ ***********************************************************************/
+EXTERN void heap_free_pages(kma_heap_t*, kma_page_t*);
+
+/***********************************************************************
+ *  Title: Releases all runs of pages of a heap
+ * ---------------------------------------------------------------------
+ *    Purpose: Gives back every run in the table of runs of a heap,
+ *             for the destroy function of the backends
+ *    Input: the heap
+ *    Output: none
+ ***********************************************************************/
+EXTERN void heap_free_runs(kma_heap_t*);
+
 /************External Declaration*****************************************/
 
 /**************Definition***************************************************/
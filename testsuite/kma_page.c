@@ -45,6 +45,18 @@
 #include <string.h>
 #include <strings.h>
 #include <stdio.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 /************Private include**********************************************/
 #include "kma_page.h"
@@ -57,16 +69,360 @@
  *  structures and arrays, line everything up in neat columns.
  */
 
+/* a free page that is still resident links itself into the free list
+ * of its chunk */
+typedef struct free_page
+{
+  struct free_page* prev;
+  struct free_page* next;
+  long freed_at;
+} free_page_t;
+
+#define LONGBITS (8 * sizeof(unsigned long))
+#define MAPWORDS (CHUNKPAGES / LONGBITS)
+
+#define TESTBIT(map, i) ((map)[(i) / LONGBITS] & (1UL << ((i) % LONGBITS)))
+#define SETBIT(map, i) ((map)[(i) / LONGBITS] |= (1UL << ((i) % LONGBITS)))
+#define CLEARBIT(map, i) ((map)[(i) / LONGBITS] &= ~(1UL << ((i) % LONGBITS)))
+
+/* a chunk hands out its resident free pages first, most recently freed
+ * first, then its lowest clean page. clean pages are not backed by
+ * memory, either because they were never touched or because they have
+ * been decommitted, so the clean pages act as a bump pointer that
+ * decommitted pages fall back behind. free_map has a bit for every free
+ * page and serves runs of contiguous pages.
+ * zero has a bit for every free page known to read as zero, because it
+ * was never touched or was decommitted with MADV_DONTNEED. pages keep
+ * theirs in the thread caches and lose it once they are handed out or
+ * have links written into them, outside of the pool lock, so zero is
+ * only ever changed atomically.
+ * the page descriptors of the chunk follow the header, indexed by page
+ * number from the chunk base.
+ * a run too long for a chunk gets a span of its own: a chunk header
+ * followed by span pages, mapped and unmapped as a whole. */
+typedef struct chunk
+{
+  struct chunk* prev;
+  struct chunk* next;
+  free_page_t free_pages;
+  unsigned long free_map[MAPWORDS];
+  unsigned long clean[MAPWORDS];
+  unsigned long zero[MAPWORDS];
+  int num_free;
+  int num_dirty;
+  int num_clean;
+  int huge;
+  int span;
+  int node;
+  long idle_since;
+  kma_page_t pages[];
+} chunk_t;
+
+/* the first pages of a chunk are reserved for its header */
+#define CHUNKFIRST ((int) ((sizeof(chunk_t) + CHUNKPAGES * sizeof(kma_page_t) \
+			    + PAGESIZE - 1) / PAGESIZE))
+#define CHUNKUSABLE (CHUNKPAGES - CHUNKFIRST)
+
+/* chunks are CHUNKSIZE aligned, so the chunk of any page is found by
+ * masking its address */
+#define CHUNKOF(x) ((chunk_t*)(((unsigned long) (x)) & ~((unsigned long) (CHUNKSIZE-1))))
+#define PAGENUM(x) ((int) ((((unsigned long) (x)) & (CHUNKSIZE-1)) / PAGESIZE))
+
+/* idle chunks are kept mapped as long as they hold no more than
+ * KMA_POOL_LOWAT pages. above that, one idle chunk is unmapped per
+ * KMA_POOL_DECAY milliseconds, oldest first. all tunables can be
+ * overridden through environment variables of the same name. */
+#ifndef KMA_POOL_LOWAT
+#define KMA_POOL_LOWAT CHUNKUSABLE
+#endif
+
+#ifndef KMA_POOL_DECAY
+#define KMA_POOL_DECAY 1000
+#endif
+
+/* free pages are given back to the system once they have been free for
+ * KMA_DECOMMIT_AGE milliseconds. ages are checked every KMA_DECOMMIT_SCAN
+ * frees. a KMA_DECOMMIT_COUNT above 0 also caps the free pages a chunk
+ * keeps resident, oldest first down to half of it; the cap is off by
+ * default, as a working set that swings by more than half a chunk would
+ * fault its pages back in on every swing. KMA_DECOMMIT_LAZY selects
+ * MADV_FREE over MADV_DONTNEED where the system has it. */
+#ifndef KMA_DECOMMIT_AGE
+#define KMA_DECOMMIT_AGE 1000
+#endif
+
+#ifndef KMA_DECOMMIT_COUNT
+#define KMA_DECOMMIT_COUNT 0
+#endif
+
+#ifndef KMA_DECOMMIT_SCAN
+#define KMA_DECOMMIT_SCAN 64
+#endif
+
+#ifndef KMA_DECOMMIT_LAZY
+#define KMA_DECOMMIT_LAZY 0
+#endif
+
+/* with KMA_HUGEPAGES set, chunks are backed by huge pages: hugetlb pages
+ * where the system has them reserved, transparent huge pages otherwise.
+ * a chunk is exactly one 2 MB huge page and is still carved into
+ * PAGESIZE pages. huge chunks are never decommitted page by page. */
+#ifndef KMA_HUGEPAGES
+#define KMA_HUGEPAGES 0
+#endif
+
+#define HUGEPAGESIZE (2 * 1024 * 1024)
+_Static_assert(CHUNKSIZE % HUGEPAGESIZE == 0,
+	       "chunks must be made of whole huge pages");
+
+/* single pages are recycled through two levels in front of the pool:
+ * every thread caches up to KMA_CACHE_PAGES free pages of its own, and
+ * threads share up to KMA_SHARED_PAGES more on a lock-free stack. only
+ * what overflows both, runs of pages and growing the pool take the pool
+ * lock. setting either to 0 in the environment turns its level off. */
+#ifndef KMA_CACHE_PAGES
+#define KMA_CACHE_PAGES 16
+#endif
+
+#ifndef KMA_SHARED_PAGES
+#define KMA_SHARED_PAGES 64
+#endif
+
+/* with KMA_ADDRESS_ORDER set, the pool always hands out the lowest free
+ * page of its lowest chunk with free pages, and reuses its lowest idle
+ * chunk, so that the pages in use stay packed at the bottom of the
+ * pool, and releases its highest idle chunk first. the page caches in
+ * front of the pool hand pages out most recently freed first, so they
+ * are turned off. */
+#ifndef KMA_ADDRESS_ORDER
+#define KMA_ADDRESS_ORDER 0
+#endif
+
+/* get_zeroed_pages() only clears the pages not known to be zero. with
+ * KMA_PREZERO set, a background thread started with the pool keeps up
+ * to that many pages zero-filled in reserve for it. */
+#ifndef KMA_PREZERO
+#define KMA_PREZERO 0
+#endif
+
+/* the top of the shared stack packs the page number of the top page
+ * with a tag that changes on every update, so that a thread holding a
+ * stale top never swaps it in (ABA). a 48-bit address space leaves 29
+ * bits for the tag. */
+#define TAGSHIFT 35
+#define TOPPAGE(t) ((void*) (((t) & ((1UL << TAGSHIFT) - 1)) * PAGESIZE))
+#define TOPTAG(t) ((t) >> TAGSHIFT)
+#define MAKETOP(p, tag) ((((unsigned long) (p)) / PAGESIZE) | ((tag) << TAGSHIFT))
+
+/* with KMA_NUMA set, every memory node has an arena of its own with
+ * its own chunk lists, shared stack and page counters. chunks prefer
+ * the memory of the node of the thread that maps them, and the kernel
+ * still falls back to other nodes when that node runs out. a thread is
+ * served by the arena of its node, and by the other arenas only once
+ * no more memory can be mapped. */
+#ifndef KMA_NUMA
+#define KMA_NUMA 1
+#endif
+
+#define MAXNODES 64
+#define NODEFILE "/sys/devices/system/node/possible"
+
+#define ARENAOF(chunk) (&arenas[(chunk)->node])
+
+/* page ids are handed to threads in blocks */
+#define IDBLOCK 1024
+
+/* every thread counts its pages in a slot of its own. threads beyond
+ * KMA_MAXTHREADS at once share one more slot. */
+#ifndef KMA_MAXTHREADS
+#define KMA_MAXTHREADS 256
+#endif
+
+/* with KMA_LATENCY set, every get_page() call is timed in cycles and
+ * counted in a histogram of the page statistics */
+#ifndef KMA_LATENCY
+#define KMA_LATENCY 0
+#endif
+
+/* arena counters are only written under the pool lock but are read
+ * without it */
+#define POOLSTAT(stats, field, n) \
+  __atomic_store_n(&(stats).field, (stats).field + (n), __ATOMIC_RELAXED)
+
+/* adds to a counter of the calling thread, atomically if its slot is
+ * shared */
+#define THREADCOUNT(cache, field, n)					\
+  do									\
+    {									\
+      if ((cache)->shared)						\
+	{								\
+	  __atomic_fetch_add(&(cache)->counters->field, (n), __ATOMIC_RELAXED); \
+	}								\
+      else								\
+	{								\
+	  __atomic_store_n(&(cache)->counters->field,			\
+			   (cache)->counters->field + (n), __ATOMIC_RELAXED); \
+	}								\
+    }									\
+  while (0)
+
+enum CHUNK_BACKING
+  {
+    SMALL,
+    TRANSPARENT,
+    HUGETLB
+  };
+
+typedef struct
+{
+  int hugepages;
+  int lowat;
+  long decay;
+  long decommit_age;
+  int decommit_count;
+  int decommit_scan;
+  int decommit_lazy;
+  int cache_pages;
+  int shared_pages;
+  int numa;
+  int address_order;
+  int prezero;
+} pool_config_t;
+
+/* the pool of a memory node. its counters count pages as requested
+ * when the arena hands them out, and as freed when they come back. */
+typedef struct
+{
+  chunk_t partial_chunks;
+  chunk_t idle_chunks;
+  int num_idle_pages;
+  unsigned long shared_top;
+  int shared_count;
+  kma_page_stat_t stats;
+} arena_t;
+
+/* the page counters of a thread, summed up by page_stats(). a slot is
+ * taken over, counts and all, by the next thread once its thread has
+ * exited, so a snapshot never has to lock out exiting threads. */
+typedef struct
+{
+  int owned;
+  int num_requested;
+  int num_freed;
+#if KMA_LATENCY
+  long latency[LATENCYBUCKETS];
+#endif
+} __attribute__ ((aligned (64))) page_counters_t;
+
+/* free pages cached by a thread, most recently freed last */
+typedef struct
+{
+  page_counters_t* counters;
+  int shared;
+  int next_id;
+  int node;
+  int count;
+  void* pages[KMA_CACHE_PAGES];
+} page_cache_t;
+
 /************Global Variables*********************************************/
-static kma_page_stat_t kma_page_stats = { 0, 0, 0, PAGESIZE };
+static kma_page_stat_t kma_page_stats = { 0, 0, 0, PAGESIZE, 0, 0, 1 };
+
+/* one arena per memory node, set up by initConfig(). partial_chunks is
+ * a circular list of the chunks that still have free pages,
+ * idle_chunks one of the chunks without any page in use, most recently
+ * idled first. */
+static arena_t arenas[MAXNODES];
+static int num_nodes = 1;
+static long last_release = 0;
+
+static pool_config_t pool_config = { KMA_HUGEPAGES,
+				     KMA_POOL_LOWAT, KMA_POOL_DECAY,
+				     KMA_DECOMMIT_AGE, KMA_DECOMMIT_COUNT,
+				     KMA_DECOMMIT_SCAN, KMA_DECOMMIT_LAZY,
+				     KMA_CACHE_PAGES, KMA_SHARED_PAGES,
+				     KMA_NUMA, KMA_ADDRESS_ORDER, KMA_PREZERO };
+static int configured = FALSE;
 
-static void* pool = NULL;
-static void* next_free_page = NULL;
+/* guards the chunk lists and everything in them */
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* the cache of a thread is flushed by a key destructor when the thread
+ * exits. only the first num_slots counter slots have ever been used. */
+static __thread page_cache_t page_cache;
+static page_counters_t thread_counters[KMA_MAXTHREADS + 1];
+static int num_slots = 0;
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+static int next_id = 0;
+
+/* every arena has a shared stack of free pages, linked through their
+ * first word. poppers counts the threads that may be reading a link
+ * right now. */
+static int poppers = 0;
+
+/* coarse clock, advanced on every decommit scan and used to stamp freed
+ * pages */
+static long coarse_now = 0;
+static int frees_since_scan = 0;
+
+/* the reserve of zero-filled pages, under the pool lock. the thread
+ * filling it waits on prezero_cond while it is full. */
+static void** zeroed = NULL;
+static int num_zeroed = 0;
+static pthread_cond_t prezero_cond = PTHREAD_COND_INITIALIZER;
+
+/* pages handed out and mapped by all arenas, for the high-water marks */
+static int pool_in_use = 0;
+static int pool_committed = 0;
+static long start_time = 0;
 
 /************Function Prototypes******************************************/
-void* allocPage();
-void freePage(void*);
-void initPages();
+void* allocPage(arena_t*);
+void* allocRun(arena_t*, int);
+void* allocSpan(arena_t*, int);
+void freeRun(void*, int);
+arena_t* lockPool();
+int currentNode();
+int countNodes();
+chunk_t* growPool(arena_t*);
+void partialInsert(chunk_t*, arena_t*);
+chunk_t* edgeChunk(chunk_t*, int);
+chunk_t* anyChunk(int, int*);
+void takePage(chunk_t*, int);
+int findRun(chunk_t*, int);
+int nextBit(unsigned long*, int, int);
+char* mapChunk(size_t, int, int*);
+void bindNode(char*, size_t, int);
+chunk_t* initChunk(int);
+void releaseChunk(chunk_t*);
+void releaseSpan(chunk_t*);
+void decayChunks(arena_t*);
+void decommitPages(chunk_t*, int, long);
+void scanChunks();
+void initConfig();
+long msNow();
+void pageInsert(free_page_t*, free_page_t*);
+void pageRemove(free_page_t*);
+void* cachePop();
+void cachePush(void*);
+void flushCache(page_cache_t*, int);
+void releasePage(void*, int*);
+kma_page_t* describePage(page_cache_t*, void*, int);
+void* popPages(int, int);
+void claimPages(void*, int, int);
+int takeZero(void*);
+void* reservePop();
+void* prezeroPages(void*);
+void registerCache(page_cache_t*);
+void makeCacheKey();
+void destroyCache(void*);
+void countPages(arena_t*, int);
+void countMapped(arena_t*, int);
+void addStats(kma_page_stat_t*, kma_page_stat_t*);
+unsigned long cycles();
+void* sharedPop(arena_t*);
+void sharedPush(arena_t*, void*);
 
 /************External Declaration*****************************************/
 
@@ -75,34 +431,164 @@ void initPages();
 kma_page_t*
 get_page()
 {
-  static int id = 0;
+#if KMA_LATENCY
+  unsigned long start, took;
   kma_page_t* res;
+  int i;
+  
+  start = cycles();
+  res = get_pages(1);
+  took = cycles() - start;
+  
+  i = (took > 0) ? 8 * sizeof(long) - 1 - __builtin_clzl(took) : 0;
+  THREADCOUNT(&page_cache, latency[(i < LATENCYBUCKETS) ? i : LATENCYBUCKETS - 1], 1);
   
-  kma_page_stats.num_requested++;
-  kma_page_stats.num_in_use++;
+  return res;
+#else
+  return get_pages(1);
+#endif
+}
+
+kma_page_t*
+get_pages(int n)
+{
+  return describePage(&page_cache, popPages(n, FALSE), n);
+}
+
+kma_page_t*
+get_zeroed_pages(int n)
+{
+  return describePage(&page_cache, popPages(n, TRUE), n);
+}
+
+void
+get_page_batch(int n, kma_page_t* pages[])
+{
+  page_cache_t* cache = &page_cache;
+  arena_t* arena = NULL;
+  void* ptr;
+  int i;
   
-  res = (kma_page_t*) malloc(sizeof(kma_page_t));
-  res->id = id++;
-  res->size = kma_page_stats.page_size;
-  res->ptr = allocPage();
+  assert(n >= 0);
   
-  assert(res->ptr != NULL);
+  if (cache->counters == NULL)
+    {
+      registerCache(cache);
+    }
+  THREADCOUNT(cache, num_requested, n);
   
-  return res;	
+  for (i = 0; i < n; i++)
+    {
+      if (cache->count > 0)
+	{
+	  ptr = cache->pages[--cache->count];
+	}
+      else if (arena != NULL || (ptr = sharedPop(&arenas[cache->node])) == NULL)
+	{
+	  // whatever is left comes from the pool under a single lock
+	  if (arena == NULL)
+	    {
+	      arena = lockPool();
+	    }
+	  ptr = allocPage(arena);
+	}
+      takeZero(ptr);
+      pages[i] = describePage(cache, ptr, 1);
+    }
+  if (arena != NULL)
+    {
+      pthread_mutex_unlock(&pool_lock);
+    }
 }
 
 void
 free_page(kma_page_t* ptr)
 {
+  free_pages(ptr);
+}
+
+void
+free_pages(kma_page_t* ptr)
+{
+  page_cache_t* cache = &page_cache;
+  int n;
+  
   assert(ptr != NULL);
   assert(ptr->ptr != NULL);
-  assert(kma_page_stats.num_in_use > 0);
   
-  kma_page_stats.num_freed++;
-  kma_page_stats.num_in_use--;
+  n = ptr->size / kma_page_stats.page_size;
+  assert(n > 0);
+  
+  if (cache->counters == NULL)
+    {
+      registerCache(cache);
+    }
+  THREADCOUNT(cache, num_freed, n);
+  
+  if (n == 1)
+    {
+      cachePush(ptr->ptr);
+      return;
+    }
+  
+  pthread_mutex_lock(&pool_lock);
+  if (CHUNKOF(ptr->ptr)->span)
+    {
+      releaseSpan(CHUNKOF(ptr->ptr));
+    }
+  else
+    {
+      freeRun(ptr->ptr, n);
+    }
+  pthread_mutex_unlock(&pool_lock);
+}
+
+void
+free_page_batch(int n, kma_page_t* pages[])
+{
+  page_cache_t* cache = &page_cache;
+  int locked = FALSE;
+  int i;
+  
+  assert(n >= 0);
+  
+  if (cache->counters == NULL)
+    {
+      registerCache(cache);
+    }
+  THREADCOUNT(cache, num_freed, n);
+  
+  for (i = 0; i < n; i++)
+    {
+      assert(pages[i] != NULL && pages[i]->ptr != NULL);
+      assert(pages[i]->size == kma_page_stats.page_size);
+      
+      if (cache->count < pool_config.cache_pages)
+	{
+	  cache->pages[cache->count++] = pages[i]->ptr;
+	}
+      else
+	{
+	  releasePage(pages[i]->ptr, &locked);
+	}
+    }
+  if (locked)
+    {
+      pthread_mutex_unlock(&pool_lock);
+    }
+}
+
+kma_page_t*
+page_of(void* ptr)
+{
+  kma_page_t* res;
+  
+  assert(ptr != NULL);
+  
+  res = &CHUNKOF(ptr)->pages[PAGENUM(ptr)];
+  assert(res->ptr == BASEADDR(ptr));
   
-  freePage(ptr->ptr);
-  free(ptr);
+  return res;
 }
 
 kma_page_stat_t*
@@ -110,71 +596,1318 @@ page_stats()
 {
   static kma_page_stat_t stats;
   
-  return memcpy(&stats, &kma_page_stats, sizeof(kma_page_stat_t));
+  page_snapshot(&stats);
+  return &stats;
+}
+
+void
+page_snapshot(kma_page_stat_t* stats)
+{
+  page_counters_t* slot;
+  int i;
+  
+  memset(stats, 0, sizeof(kma_page_stat_t));
+  stats->page_size = PAGESIZE;
+  stats->num_nodes = num_nodes;
+  
+  for (slot = thread_counters;
+       slot < thread_counters + __atomic_load_n(&num_slots, __ATOMIC_ACQUIRE); slot++)
+    {
+      stats->num_requested += __atomic_load_n(&slot->num_requested, __ATOMIC_RELAXED);
+      stats->num_freed += __atomic_load_n(&slot->num_freed, __ATOMIC_RELAXED);
+#if KMA_LATENCY
+      for (i = 0; i < LATENCYBUCKETS; i++)
+	{
+	  stats->latency[i] += __atomic_load_n(&slot->latency[i], __ATOMIC_RELAXED);
+	}
+#endif
+    }
+  stats->num_in_use = stats->num_requested - stats->num_freed;
+  
+  for (i = 0; i < num_nodes; i++)
+    {
+      addStats(stats, &arenas[i].stats);
+    }
+  
+  stats->max_in_use = __atomic_load_n(&kma_page_stats.max_in_use, __ATOMIC_RELAXED);
+  stats->max_committed = __atomic_load_n(&kma_page_stats.max_committed, __ATOMIC_RELAXED);
+  
+  if (__atomic_load_n(&configured, __ATOMIC_ACQUIRE))
+    {
+      stats->uptime = msNow() - start_time;
+    }
+  if (stats->uptime > 0)
+    {
+      stats->request_rate = stats->num_requested * 1000.0 / stats->uptime;
+      stats->free_rate = stats->num_freed * 1000.0 / stats->uptime;
+    }
+}
+
+kma_page_stat_t*
+page_node_stats(int node)
+{
+  static kma_page_stat_t stats;
+  
+  assert(node >= 0 && node < num_nodes);
+  
+  memset(&stats, 0, sizeof(kma_page_stat_t));
+  addStats(&stats, &arenas[node].stats);
+  stats.num_requested = __atomic_load_n(&arenas[node].stats.num_requested, __ATOMIC_RELAXED);
+  stats.num_freed = __atomic_load_n(&arenas[node].stats.num_freed, __ATOMIC_RELAXED);
+  stats.num_in_use = stats.num_requested - stats.num_freed;
+  stats.page_size = PAGESIZE;
+  stats.num_nodes = num_nodes;
+  stats.max_in_use = __atomic_load_n(&arenas[node].stats.max_in_use, __ATOMIC_RELAXED);
+  stats.max_committed = __atomic_load_n(&arenas[node].stats.max_committed, __ATOMIC_RELAXED);
+  
+  return &stats;
+}
+
+/* adds the mapping counters of an arena, read one at a time without
+ * the lock. the arenas count their pages at the pool, the threads count
+ * the pages requested and freed. */
+void
+addStats(kma_page_stat_t* stats, kma_page_stat_t* arena)
+{
+  stats->num_committed += __atomic_load_n(&arena->num_committed, __ATOMIC_RELAXED);
+  stats->num_resident += __atomic_load_n(&arena->num_resident, __ATOMIC_RELAXED);
+  stats->num_grows += __atomic_load_n(&arena->num_grows, __ATOMIC_RELAXED);
+  stats->num_shrinks += __atomic_load_n(&arena->num_shrinks, __ATOMIC_RELAXED);
+  stats->num_decommitted += __atomic_load_n(&arena->num_decommitted, __ATOMIC_RELAXED);
 }
 
+/* takes a page from the cache of this thread, then from the shared
+ * stack, then from the pool. a trip to the pool refills half the cache
+ * from the chunk at hand while the lock is held. */
 void*
-allocPage()
+cachePop()
 {
-  void* res;
+  page_cache_t* cache = &page_cache;
+  arena_t* arena;
+  void* ptr;
   
-  if (pool == NULL)
+  if (cache->count > 0)
     {
-      initPages();
+      return cache->pages[--cache->count];
     }
   
-  res = next_free_page;
+  ptr = sharedPop(&arenas[cache->node]);
+  if (ptr != NULL)
+    {
+      return ptr;
+    }
   
-  if (res == NULL)
+  arena = lockPool();
+  ptr = allocPage(arena);
+  // never grow the pool just to fill the cache
+  while (cache->count < pool_config.cache_pages / 2
+	 && arena->partial_chunks.next != &arena->partial_chunks)
     {
-      error("error: all pages already allocated", "");
+      cache->pages[cache->count++] = allocPage(arena);
     }
+  pthread_mutex_unlock(&pool_lock);
   
-  next_free_page = *((void**)next_free_page);
+  return ptr;
+}
+
+/* puts a free page into the cache of this thread. a full cache passes
+ * its older half on first. */
+void
+cachePush(void* ptr)
+{
+  page_cache_t* cache = &page_cache;
   
-  assert(res != NULL);
+  if (cache->count >= pool_config.cache_pages)
+    {
+      flushCache(cache, pool_config.cache_pages / 2);
+    }
   
-  return res;
+  if (cache->count < pool_config.cache_pages)
+    {
+      cache->pages[cache->count++] = ptr;
+    }
+  else
+    {
+      // caching is turned off
+      cache->pages[cache->count++] = ptr;
+      flushCache(cache, 0);
+    }
 }
 
+/* passes all but the keep most recently freed pages of a cache on to
+ * the shared stack of their node, and to the pool once the stack is
+ * full */
 void
-freePage(void* ptr)
+flushCache(page_cache_t* cache, int keep)
 {
-  assert(ptr != NULL);
+  int locked = FALSE;
+  int i, n;
+  
+  n = cache->count - keep;
+  for (i = 0; i < n; i++)
+    {
+      releasePage(cache->pages[i], &locked);
+    }
+  if (locked)
+    {
+      pthread_mutex_unlock(&pool_lock);
+    }
+  
+  memmove(cache->pages, cache->pages + n, keep * sizeof(void*));
+  cache->count = keep;
+}
+
+/* pushes a page that no cache has room for onto the shared stack of its
+ * node, or returns it to the pool once the stack is full. the pool lock
+ * is taken on first need and left to the caller to drop. */
+void
+releasePage(void* ptr, int* locked)
+{
+  arena_t* arena;
+  
+  arena = ARENAOF(CHUNKOF(ptr));
+  if (__atomic_load_n(&arena->shared_count, __ATOMIC_RELAXED) < pool_config.shared_pages)
+    {
+      sharedPush(arena, ptr);
+      return;
+    }
+  
+  if (!*locked)
+    {
+      pthread_mutex_lock(&pool_lock);
+      *locked = TRUE;
+    }
+  freeRun(ptr, 1);
+}
+
+/* takes n pages for the calling thread: single pages through its cache,
+ * runs from the pool. with zero set the pages are zero-filled: single
+ * pages come from the reserve of zero-filled pages, otherwise only the
+ * pages not known to be zero are cleared. */
+void*
+popPages(int n, int zero)
+{
+  page_cache_t* cache = &page_cache;
+  arena_t* arena;
+  void* ptr;
+  
+  assert(n > 0);
+  
+  if (cache->counters == NULL)
+    {
+      registerCache(cache);
+    }
+  THREADCOUNT(cache, num_requested, n);
   
-  *((void**)ptr) = next_free_page;
-  next_free_page = ptr;
+  if (n == 1 && zero && __atomic_load_n(&num_zeroed, __ATOMIC_RELAXED) > 0
+      && (ptr = reservePop()) != NULL)
+    {
+      return ptr;
+    }
+  
+  if (n == 1)
+    {
+      ptr = cachePop();
+      if (!takeZero(ptr) && zero)
+	{
+	  memset(ptr, 0, PAGESIZE);
+	}
+      return ptr;
+    }
   
-  if (kma_page_stats.num_in_use == 0)
+  arena = lockPool();
+  if (n <= CHUNKUSABLE)
+    {
+      ptr = allocRun(arena, n);
+    }
+  else
     {
-      free(pool);
-      pool = NULL;
-      next_free_page = NULL;
+      ptr = allocSpan(arena, n);
     }
+  pthread_mutex_unlock(&pool_lock);
+  assert(ptr != NULL);
+  
+  claimPages(ptr, n, zero);
+  return ptr;
 }
 
+/* clears the zero bits of a run of n pages just handed out, and with
+ * fill set clears the pages that were not known to be zero. spans are
+ * fresh from mmap. */
 void
-initPages()
+claimPages(void* ptr, int n, int fill)
+{
+  int i;
+  
+  if (CHUNKOF(ptr)->span)
+    {
+      return;
+    }
+  
+  for (i = 0; i < n; i++)
+    {
+      if (!takeZero((char*) ptr + i * PAGESIZE) && fill)
+	{
+	  memset((char*) ptr + i * PAGESIZE, 0, PAGESIZE);
+	}
+    }
+}
+
+/* clears the zero bit of a page in a chunk, returns whether it was set */
+int
+takeZero(void* page)
 {
+  chunk_t* chunk = CHUNKOF(page);
+  unsigned long bit;
   int i;
   
-  assert(next_free_page == NULL);
-  assert(pool == NULL);
+  i = PAGENUM(page);
+  bit = 1UL << (i % LONGBITS);
+  if ((__atomic_load_n(&chunk->zero[i / LONGBITS], __ATOMIC_RELAXED) & bit) == 0)
+    {
+      return FALSE;
+    }
+  return (__atomic_fetch_and(&chunk->zero[i / LONGBITS], ~bit, __ATOMIC_RELAXED) & bit) != 0;
+}
+
+/* takes a page from the reserve of zero-filled pages, NULL if it is
+ * empty */
+void*
+reservePop()
+{
+  void* ptr = NULL;
+  
+  pthread_mutex_lock(&pool_lock);
+  if (num_zeroed > 0)
+    {
+      ptr = zeroed[num_zeroed - 1];
+      __atomic_store_n(&num_zeroed, num_zeroed - 1, __ATOMIC_RELAXED);
+      pthread_cond_signal(&prezero_cond);
+    }
+  pthread_mutex_unlock(&pool_lock);
   
-  //pool = calloc(MAXPAGES, PAGESIZE);
-  int result = posix_memalign(&pool, PAGESIZE, MAXPAGES * PAGESIZE);
-  if(result)
-    error("Error using posix_memalign to allocate memory", "");
-  next_free_page = pool;
+  return ptr;
+}
+
+/* keeps the reserve of zero-filled pages topped up. the pages are taken
+ * like any other, and cleared outside of the pool lock. */
+void*
+prezeroPages(void* arg)
+{
+  arena_t* arena;
+  void* ptr;
   
-  // use ptr to point to the next free page struct
-  for (i = 0; i < (MAXPAGES - 1); i++)
+  arena = lockPool();
+  for (;;)
     {
-      void* ptr = (pool + i * PAGESIZE);
-      void* next = ptr + PAGESIZE;
+      while (num_zeroed >= pool_config.prezero)
+	{
+	  pthread_cond_wait(&prezero_cond, &pool_lock);
+	}
+      ptr = allocPage(arena);
+      pthread_mutex_unlock(&pool_lock);
       
-      *((void**) ptr) = next;
+      if (!takeZero(ptr))
+	{
+	  memset(ptr, 0, PAGESIZE);
+	}
+      
+      arena = lockPool();
+      zeroed[num_zeroed] = ptr;
+      __atomic_store_n(&num_zeroed, num_zeroed + 1, __ATOMIC_RELAXED);
+    }
+  
+  return NULL;
+}
+
+/* fills in the descriptor of a run of n pages that starts at ptr */
+kma_page_t*
+describePage(page_cache_t* cache, void* ptr, int n)
+{
+  kma_page_t* res;
+  
+  res = &CHUNKOF(ptr)->pages[PAGENUM(ptr)];
+  if (cache->next_id % IDBLOCK == 0)
+    {
+      cache->next_id = __atomic_fetch_add(&next_id, IDBLOCK, __ATOMIC_RELAXED);
+    }
+  res->id = cache->next_id++;
+  res->size = (size_t) n * kma_page_stats.page_size;
+  res->ptr = ptr;
+  res->tag = 0;
+  
+  return res;
+}
+
+/* gives the calling thread a counter slot, and makes sure the pages it
+ * caches do not outlive it */
+void
+registerCache(page_cache_t* cache)
+{
+  int owned, used;
+  int i;
+  
+  pthread_once(&cache_once, makeCacheKey);
+  pthread_setspecific(cache_key, cache);
+  
+  for (i = 0; i < KMA_MAXTHREADS; i++)
+    {
+      owned = FALSE;
+      if (__atomic_compare_exchange_n(&thread_counters[i].owned, &owned, TRUE, FALSE,
+				      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+	{
+	  break;
+	}
+    }
+  cache->counters = &thread_counters[i];
+  cache->shared = (i == KMA_MAXTHREADS);
+  
+  used = __atomic_load_n(&num_slots, __ATOMIC_RELAXED);
+  while (used <= i
+	 && !__atomic_compare_exchange_n(&num_slots, &used, i + 1, FALSE,
+					 __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+    ;
+}
+
+void
+makeCacheKey()
+{
+  pthread_key_create(&cache_key, destroyCache);
+}
+
+void
+destroyCache(void* arg)
+{
+  page_cache_t* cache = (page_cache_t*) arg;
+  
+  flushCache(cache, 0);
+  
+  // hand the slot on; whatever this thread still frees on its way out
+  // is counted in the shared slot
+  if (!cache->shared)
+    {
+      __atomic_store_n(&cache->counters->owned, FALSE, __ATOMIC_RELEASE);
+      cache->counters = &thread_counters[KMA_MAXTHREADS];
+      cache->shared = TRUE;
+    }
+}
+
+/* pops the shared stack, NULL if it is empty. the link of the top page
+ * may be read after another thread popped the page and overwrote it;
+ * the tag makes the swap fail then. releaseChunk() waits for poppers so
+ * that the page cannot be unmapped under the read. */
+void*
+sharedPop(arena_t* arena)
+{
+  unsigned long top, next;
+  void* ptr;
+  
+  if (__atomic_load_n(&arena->shared_count, __ATOMIC_RELAXED) == 0)
+    {
+      return NULL;
+    }
+  
+  __atomic_fetch_add(&poppers, 1, __ATOMIC_SEQ_CST);
+  top = __atomic_load_n(&arena->shared_top, __ATOMIC_SEQ_CST);
+  do
+    {
+      ptr = TOPPAGE(top);
+      if (ptr == NULL)
+	{
+	  break;
+	}
+      next = MAKETOP(__atomic_load_n((void**) ptr, __ATOMIC_RELAXED),
+		     TOPTAG(top) + 1);
     }
+  while (!__atomic_compare_exchange_n(&arena->shared_top, &top, next, TRUE,
+				      __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+  __atomic_fetch_sub(&poppers, 1, __ATOMIC_SEQ_CST);
+  
+  if (ptr != NULL)
+    {
+      __atomic_fetch_sub(&arena->shared_count, 1, __ATOMIC_RELAXED);
+    }
+  
+  return ptr;
+}
+
+void
+sharedPush(arena_t* arena, void* ptr)
+{
+  unsigned long top, next;
+  
+  assert(ptr == BASEADDR(ptr));
+  assert(TOPPAGE(MAKETOP(ptr, 0UL)) == ptr);
+  
+  // the link goes into the page, like the links of the pool do
+  takeZero(ptr);
+  
+  top = __atomic_load_n(&arena->shared_top, __ATOMIC_RELAXED);
+  do
+    {
+      __atomic_store_n((void**) ptr, TOPPAGE(top), __ATOMIC_RELAXED);
+      next = MAKETOP(ptr, TOPTAG(top) + 1);
+    }
+  while (!__atomic_compare_exchange_n(&arena->shared_top, &top, next, TRUE,
+				      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  
+  __atomic_fetch_add(&arena->shared_count, 1, __ATOMIC_RELAXED);
+}
+
+void
+chunkInsert(chunk_t* chunk, chunk_t* list)
+{
+  chunk->prev = list;
+  chunk->next = list->next;
+  list->next->prev = chunk;
+  list->next = chunk;
+}
+
+void
+chunkRemove(chunk_t* chunk)
+{
+  chunk->prev->next = chunk->next;
+  chunk->next->prev = chunk->prev;
+  chunk->prev = chunk->next = NULL;
+}
+
+/* takes the pool lock and returns the arena of the calling thread */
+arena_t*
+lockPool()
+{
+  pthread_mutex_lock(&pool_lock);
+  if (!configured)
+    {
+      initConfig();
+    }
+  
+  page_cache.node = currentNode();
+  // idle chunks decay on trips to the pool that allocate, too
+  decayChunks(&arenas[page_cache.node]);
+  return &arenas[page_cache.node];
+}
+
+/* the memory node the calling thread runs on */
+int
+currentNode()
+{
+  unsigned int cpu, node;
+  
+  if (num_nodes == 1 || syscall(SYS_getcpu, &cpu, &node, NULL) != 0
+      || node >= num_nodes)
+    {
+      return 0;
+    }
+  return node;
+}
+
+/* makes a chunk without any page in use available for allocation, NULL
+ * if no more memory can be mapped */
+chunk_t*
+growPool(arena_t* arena)
+{
+  chunk_t* chunk;
+  int i;
+  
+  if (arena->idle_chunks.next == &arena->idle_chunks)
+    {
+      // every page of the node is in use, grow its arena by one chunk
+      chunk = initChunk(arena - arenas);
+      if (chunk != NULL)
+	{
+	  partialInsert(chunk, arena);
+	  return chunk;
+	}
+      
+      // out of memory, fall back to an idle chunk of another node
+      for (i = 0; i < num_nodes && arena->idle_chunks.next == &arena->idle_chunks; i++)
+	{
+	  arena = &arenas[i];
+	}
+      if (arena->idle_chunks.next == &arena->idle_chunks)
+	{
+	  return NULL;
+	}
+    }
+  
+  // reuse the most recently idled chunk, it is still warm
+  chunk = pool_config.address_order
+    ? edgeChunk(&arena->idle_chunks, FALSE) : arena->idle_chunks.next;
+  chunkRemove(chunk);
+  arena->num_idle_pages -= CHUNKUSABLE;
+  partialInsert(chunk, arena);
+  
+  return chunk;
+}
+
+/* makes a chunk available for allocation, keeping the chunks in
+ * address order if the pool is */
+void
+partialInsert(chunk_t* chunk, arena_t* arena)
+{
+  chunk_t* prev = &arena->partial_chunks;
+  
+  if (pool_config.address_order)
+    {
+      while (prev->next != &arena->partial_chunks && prev->next < chunk)
+	{
+	  prev = prev->next;
+	}
+    }
+  chunkInsert(chunk, prev);
+}
+
+/* finds the lowest (or highest) chunk of a list that is not empty */
+chunk_t*
+edgeChunk(chunk_t* list, int highest)
+{
+  chunk_t* edge = list->next;
+  chunk_t* chunk;
+  
+  for (chunk = edge->next; chunk != list; chunk = chunk->next)
+    {
+      if (highest ? chunk > edge : chunk < edge)
+	{
+	  edge = chunk;
+	}
+    }
+  
+  return edge;
+}
+
+/* finds a chunk of any node with a run of n free pages, for when no more
+ * memory can be mapped, and sets first to the run */
+chunk_t*
+anyChunk(int n, int* first)
+{
+  chunk_t* chunk;
+  int i;
+  
+  for (i = 0; i < num_nodes; i++)
+    {
+      for (chunk = arenas[i].partial_chunks.next; chunk != &arenas[i].partial_chunks;
+	   chunk = chunk->next)
+	{
+	  if (chunk->num_free >= n && (*first = findRun(chunk, n)) >= 0)
+	    {
+	      return chunk;
+	    }
+	}
+    }
+  
+  error("error: unable to map a page chunk", "");
+  return NULL;
+}
+
+void*
+allocPage(arena_t* arena)
+{
+  chunk_t* chunk;
+  int i;
+  
+  chunk = arena->partial_chunks.next;
+  if (chunk == &arena->partial_chunks && (chunk = growPool(arena)) == NULL)
+    {
+      chunk = anyChunk(1, &i);
+    }
+  
+  if (pool_config.address_order)
+    {
+      i = nextBit(chunk->free_map, CHUNKFIRST, 1);
+    }
+  else if (chunk->num_dirty > 0)
+    {
+      i = PAGENUM(chunk->free_pages.next);
+    }
+  else
+    {
+      // faulted in on first touch
+      i = nextBit(chunk->clean, CHUNKFIRST, 1);
+    }
+  takePage(chunk, i);
+  
+  if (chunk->num_free == 0)
+    {
+      chunkRemove(chunk);
+    }
+  
+  return (char*) chunk + i * PAGESIZE;
+}
+
+/* allocates n contiguous pages from the first chunk that has a long
+ * enough run of free pages */
+void*
+allocRun(arena_t* arena, int n)
+{
+  chunk_t* chunk;
+  int first = -1;
+  int i;
+  
+  for (chunk = arena->partial_chunks.next; chunk != &arena->partial_chunks;
+       chunk = chunk->next)
+    {
+      if (chunk->num_free >= n && (first = findRun(chunk, n)) >= 0)
+	{
+	  break;
+	}
+    }
+  
+  if (chunk == &arena->partial_chunks)
+    {
+      chunk = growPool(arena);
+      if (chunk != NULL)
+	{
+	  first = findRun(chunk, n);
+	}
+      else
+	{
+	  chunk = anyChunk(n, &first);
+	}
+    }
+  assert(first >= CHUNKFIRST);
+  
+  for (i = first; i < first + n; i++)
+    {
+      takePage(chunk, i);
+    }
+  
+  if (chunk->num_free == 0)
+    {
+      chunkRemove(chunk);
+    }
+  
+  return (char*) chunk + first * PAGESIZE;
+}
+
+/* maps a span of its own for a run that does not fit into a chunk */
+void*
+allocSpan(arena_t* arena, int n)
+{
+  chunk_t* chunk;
+  int huge;
+  
+  chunk = (chunk_t*) mapChunk((size_t) (CHUNKFIRST + n) * PAGESIZE, arena - arenas, &huge);
+  if (chunk == NULL)
+    {
+      error("error: unable to map a page chunk", "");
+    }
+  chunk->prev = chunk->next = NULL;
+  chunk->num_free = 0;
+  chunk->huge = huge;
+  chunk->span = n;
+  chunk->node = arena - arenas;
+  
+  countMapped(arena, n);
+  countPages(arena, n);
+  POOLSTAT(arena->stats, num_resident, n);
+  
+  return (char*) chunk + CHUNKFIRST * PAGESIZE;
+}
+
+/* takes free page i of a chunk off the free list or the clean map */
+void
+takePage(chunk_t* chunk, int i)
+{
+  assert(TESTBIT(chunk->free_map, i));
+  
+  CLEARBIT(chunk->free_map, i);
+  if (TESTBIT(chunk->clean, i))
+    {
+      CLEARBIT(chunk->clean, i);
+      chunk->num_clean--;
+      if (chunk->huge != HUGETLB)
+	{
+	  POOLSTAT(ARENAOF(chunk)->stats, num_resident, 1);
+	}
+    }
+  else
+    {
+      pageRemove((free_page_t*) ((char*) chunk + i * PAGESIZE));
+      chunk->num_dirty--;
+    }
+  chunk->num_free--;
+  countPages(ARENAOF(chunk), 1);
+}
+
+/* finds the lowest run of n free pages in a chunk, -1 if there is none */
+int
+findRun(chunk_t* chunk, int n)
+{
+  int start, end;
+  
+  start = nextBit(chunk->free_map, CHUNKFIRST, 1);
+  while (start < CHUNKPAGES)
+    {
+      end = nextBit(chunk->free_map, start, 0);
+      if (end - start >= n)
+	{
+	  return start;
+	}
+      start = nextBit(chunk->free_map, end, 1);
+    }
+  
+  return -1;
+}
+
+/* finds the first bit at or above from that is set (or clear), a word at
+ * a time. returns CHUNKPAGES if there is none. */
+int
+nextBit(unsigned long* map, int from, int set)
+{
+  unsigned long word;
+  int i;
+  
+  if (from >= CHUNKPAGES)
+    {
+      return CHUNKPAGES;
+    }
+  
+  i = from / LONGBITS;
+  word = (set ? map[i] : ~map[i]) & (~0UL << (from % LONGBITS));
+  while (word == 0)
+    {
+      if (++i == MAPWORDS)
+	{
+	  return CHUNKPAGES;
+	}
+      word = set ? map[i] : ~map[i];
+    }
+  
+  return i * LONGBITS + __builtin_ctzl(word);
+}
+
+void
+freeRun(void* ptr, int n)
+{
+  chunk_t* chunk;
+  arena_t* arena;
+  char* page;
+  int i;
+  
+  assert(ptr != NULL);
+  assert(ptr == BASEADDR(ptr));
+  
+  chunk = CHUNKOF(ptr);
+  arena = ARENAOF(chunk);
+  
+  for (i = 0; i < n; i++)
+    {
+      page = (char*) ptr + i * PAGESIZE;
+      assert(!TESTBIT(chunk->free_map, PAGENUM(page)));
+      
+      SETBIT(chunk->free_map, PAGENUM(page));
+      // the links go into the page, which may come from a cache with
+      // its zero bit still set
+      takeZero(page);
+      pageInsert((free_page_t*) page, &chunk->free_pages);
+      ((free_page_t*) page)->freed_at = coarse_now;
+    }
+  chunk->num_dirty += n;
+  chunk->num_free += n;
+  countPages(arena, -n);
+  
+  if (chunk->num_free == n)
+    {
+      partialInsert(chunk, arena);
+    }
+  
+  if (chunk->num_free == CHUNKUSABLE)
+    {
+      // the chunk went idle, retain it until it decays
+      chunkRemove(chunk);
+      chunkInsert(chunk, &arena->idle_chunks);
+      chunk->idle_since = msNow();
+      arena->num_idle_pages += CHUNKUSABLE;
+    }
+  
+  if (pool_config.decommit_count > 0 && chunk->num_dirty > pool_config.decommit_count
+      && chunk->huge == SMALL)
+    {
+      decommitPages(chunk, pool_config.decommit_count / 2, -1);
+    }
+  
+  frees_since_scan += n;
+  if (frees_since_scan >= pool_config.decommit_scan)
+    {
+      scanChunks();
+    }
+  
+  decayChunks(arena);
+}
+
+/* counts n pages handed out by an arena, or taken back if n is
+ * negative, and keeps the high-water marks */
+void
+countPages(arena_t* arena, int n)
+{
+  if (n > 0)
+    {
+      POOLSTAT(arena->stats, num_requested, n);
+    }
+  else
+    {
+      POOLSTAT(arena->stats, num_freed, -n);
+    }
+  
+  if (arena->stats.num_requested - arena->stats.num_freed > arena->stats.max_in_use)
+    {
+      __atomic_store_n(&arena->stats.max_in_use,
+		       arena->stats.num_requested - arena->stats.num_freed, __ATOMIC_RELAXED);
+    }
+  
+  pool_in_use += n;
+  if (pool_in_use > kma_page_stats.max_in_use)
+    {
+      __atomic_store_n(&kma_page_stats.max_in_use, pool_in_use, __ATOMIC_RELAXED);
+    }
+}
+
+/* counts a chunk or span of n pages mapped for an arena, or unmapped if
+ * n is negative, and keeps the high-water marks */
+void
+countMapped(arena_t* arena, int n)
+{
+  POOLSTAT(arena->stats, num_committed, n);
+  if (n > 0)
+    {
+      POOLSTAT(arena->stats, num_grows, 1);
+    }
+  else
+    {
+      POOLSTAT(arena->stats, num_shrinks, 1);
+    }
+  
+  if (arena->stats.num_committed > arena->stats.max_committed)
+    {
+      __atomic_store_n(&arena->stats.max_committed, arena->stats.num_committed,
+		       __ATOMIC_RELAXED);
+    }
+  
+  pool_committed += n;
+  if (pool_committed > kma_page_stats.max_committed)
+    {
+      __atomic_store_n(&kma_page_stats.max_committed, pool_committed, __ATOMIC_RELAXED);
+    }
+}
+
+void
+pageInsert(free_page_t* page, free_page_t* list)
+{
+  page->prev = list;
+  page->next = list->next;
+  list->next->prev = page;
+  list->next = page;
+}
+
+void
+pageRemove(free_page_t* page)
+{
+  page->prev->next = page->next;
+  page->next->prev = page->prev;
+}
+
+/* decommits resident free pages of a chunk, oldest first, until at most
+ * keep remain and none of them was freed at or before the given time.
+ * adjacent pages are handed back to the system in a single run. */
+void
+decommitPages(chunk_t* chunk, int keep, long before)
+{
+  unsigned long pending[MAPWORDS];
+  free_page_t* page;
+  int advice, count, i, start;
+  
+  memset(pending, 0, sizeof(pending));
+  count = 0;
+  
+  page = chunk->free_pages.prev;
+  while (page != &chunk->free_pages
+	 && (chunk->num_dirty > keep || page->freed_at <= before))
+    {
+      free_page_t* prev = page->prev;
+      
+      i = PAGENUM(page);
+      pageRemove(page);
+      SETBIT(pending, i);
+      SETBIT(chunk->clean, i);
+      chunk->num_dirty--;
+      chunk->num_clean++;
+      count++;
+      page = prev;
+    }
+  
+  if (count == 0)
+    {
+      return;
+    }
+  
+#ifdef MADV_FREE
+  advice = pool_config.decommit_lazy ? MADV_FREE : MADV_DONTNEED;
+#else
+  advice = MADV_DONTNEED;
+#endif
+  
+  start = nextBit(pending, CHUNKFIRST, 1);
+  while (start < CHUNKPAGES)
+    {
+      i = nextBit(pending, start, 0);
+      madvise((char*) chunk + start * PAGESIZE, (i - start) * PAGESIZE, advice);
+      start = nextBit(pending, i, 1);
+    }
+  
+  // lazily freed pages keep their contents until the system needs them
+  if (advice == MADV_DONTNEED)
+    {
+      for (i = 0; i < MAPWORDS; i++)
+	{
+	  __atomic_fetch_or(&chunk->zero[i], pending[i], __ATOMIC_RELAXED);
+	}
+    }
+  
+  POOLSTAT(ARENAOF(chunk)->stats, num_resident, -count);
+  POOLSTAT(ARENAOF(chunk)->stats, num_decommitted, count);
+}
+
+/* advances the coarse clock, decommits every free page that has aged
+ * past the threshold and lets idle chunks decay */
+void
+scanChunks()
+{
+  chunk_t* chunk;
+  arena_t* arena;
+  
+  frees_since_scan = 0;
+  coarse_now = msNow();
+  
+  for (arena = arenas; arena < arenas + num_nodes; arena++)
+    {
+      for (chunk = arena->partial_chunks.next; chunk != &arena->partial_chunks;
+	   chunk = chunk->next)
+	{
+	  if (chunk->huge == SMALL)
+	    {
+	      decommitPages(chunk, CHUNKUSABLE, coarse_now - pool_config.decommit_age);
+	    }
+	}
+      for (chunk = arena->idle_chunks.next; chunk != &arena->idle_chunks;
+	   chunk = chunk->next)
+	{
+	  if (chunk->huge == SMALL)
+	    {
+	      decommitPages(chunk, CHUNKUSABLE, coarse_now - pool_config.decommit_age);
+	    }
+	}
+      decayChunks(arena);
+    }
+}
+
+/* releases the oldest idle chunk, or the highest one in address order,
+ * once it has been idle for a full decay period, but never more than
+ * one chunk per period and only while the idle pages are above the
+ * low-water mark. checked on every trip to the pool, allocating or
+ * freeing, so that a pool no longer freeing still shrinks */
+void
+decayChunks(arena_t* arena)
+{
+  chunk_t* chunk;
+  long now;
+  
+  if (arena->num_idle_pages <= pool_config.lowat)
+    {
+      return;
+    }
+  assert(arena->idle_chunks.prev != &arena->idle_chunks);
+  chunk = pool_config.address_order
+    ? edgeChunk(&arena->idle_chunks, TRUE) : arena->idle_chunks.prev;
+  
+  now = msNow();
+  if (now - chunk->idle_since < pool_config.decay
+      || now - last_release < pool_config.decay)
+    {
+      return;
+    }
+  
+  chunkRemove(chunk);
+  arena->num_idle_pages -= CHUNKUSABLE;
+  last_release = now;
+  releaseChunk(chunk);
+}
+
+/* maps length bytes at a CHUNKSIZE aligned address on a node and
+ * reports how they are backed, NULL if the system is out of memory */
+char*
+mapChunk(size_t length, int node, int* huge)
+{
+  char* raw;
+  char* base;
+  size_t head;
+  
+  *huge = SMALL;
+#ifdef MAP_HUGETLB
+  if (pool_config.hugepages && length == CHUNKSIZE)
+    {
+      // hugetlb mappings come aligned to the huge page size
+      raw = mmap(NULL, CHUNKSIZE, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      if (raw != MAP_FAILED && raw == (char*) CHUNKOF(raw))
+	{
+	  bindNode(raw, CHUNKSIZE, node);
+	  *huge = HUGETLB;
+	  return raw;
+	}
+      else if (raw != MAP_FAILED)
+	{
+	  munmap(raw, CHUNKSIZE);
+	}
+    }
+#endif
+  
+  // over-map so that a CHUNKSIZE aligned window can be cut out
+  raw = mmap(NULL, length + CHUNKSIZE, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (raw == MAP_FAILED)
+    {
+      return NULL;
+    }
+  
+  base = (char*) CHUNKOF(raw + CHUNKSIZE - 1);
+  head = base - raw;
+  if (head > 0)
+    {
+      munmap(raw, head);
+    }
+  munmap(base + length, CHUNKSIZE - head);
+  bindNode(base, length, node);
+  
+#ifdef MADV_HUGEPAGE
+  if (pool_config.hugepages && madvise(base, length, MADV_HUGEPAGE) == 0)
+    {
+      *huge = TRANSPARENT;
+    }
+#endif
+  
+  return base;
+}
+
+/* makes a mapping prefer the memory of a node. done before the mapping
+ * is touched, and it still holds when decommitted pages fault back in. */
+void
+bindNode(char* base, size_t length, int node)
+{
+  unsigned long mask = 1UL << node;
+  
+  if (num_nodes > 1)
+    {
+      syscall(SYS_mbind, base, length, MPOL_PREFERRED, &mask, MAXNODES + 1, 0);
+    }
+}
+
+chunk_t*
+initChunk(int node)
+{
+  chunk_t* chunk;
+  int huge;
+  int i;
+  
+  chunk = (chunk_t*) mapChunk(CHUNKSIZE, node, &huge);
+  if (chunk == NULL)
+    {
+      return NULL;
+    }
+  
+  // every usable page starts out free and untouched
+  chunk->prev = chunk->next = NULL;
+  chunk->free_pages.prev = chunk->free_pages.next = &chunk->free_pages;
+  for (i = CHUNKFIRST; i < CHUNKPAGES; i++)
+    {
+      SETBIT(chunk->free_map, i);
+      SETBIT(chunk->clean, i);
+      SETBIT(chunk->zero, i);
+    }
+  chunk->num_free = CHUNKUSABLE;
+  chunk->num_clean = CHUNKUSABLE;
+  chunk->huge = huge;
+  chunk->node = node;
+  
+  // a hugetlb page is backed as a whole when it is mapped, transparent
+  // huge pages are only a hint and are counted page by page on touch
+  countMapped(ARENAOF(chunk), CHUNKUSABLE);
+  if (huge == HUGETLB)
+    {
+      POOLSTAT(ARENAOF(chunk)->stats, num_resident, CHUNKUSABLE);
+    }
+  
+  return chunk;
+}
+
+void
+releaseChunk(chunk_t* chunk)
+{
+  assert(chunk->num_free == CHUNKUSABLE);
+  
+  countMapped(ARENAOF(chunk), -CHUNKUSABLE);
+  POOLSTAT(ARENAOF(chunk)->stats, num_resident,
+	   (chunk->huge != HUGETLB) ? -chunk->num_dirty : -CHUNKUSABLE);
+  
+  // none of its pages is on the shared stack any more, but a popper may
+  // still be reading through a stale top
+  while (__atomic_load_n(&poppers, __ATOMIC_SEQ_CST) > 0)
+    {
+      sched_yield();
+    }
+  
+  munmap(chunk, CHUNKSIZE);
+}
+
+void
+releaseSpan(chunk_t* chunk)
+{
+  countPages(ARENAOF(chunk), -chunk->span);
+  countMapped(ARENAOF(chunk), -chunk->span);
+  POOLSTAT(ARENAOF(chunk)->stats, num_resident, -chunk->span);
+  
+  munmap(chunk, (size_t) (CHUNKFIRST + chunk->span) * PAGESIZE);
+}
+
+void
+initConfig()
+{
+  char* value;
+  int i;
+  
+  if ((value = getenv("KMA_HUGEPAGES")) != NULL)
+    {
+      pool_config.hugepages = atoi(value);
+    }
+  if ((value = getenv("KMA_POOL_LOWAT")) != NULL)
+    {
+      pool_config.lowat = atoi(value);
+    }
+  if ((value = getenv("KMA_POOL_DECAY")) != NULL)
+    {
+      pool_config.decay = atol(value);
+    }
+  if ((value = getenv("KMA_DECOMMIT_AGE")) != NULL)
+    {
+      pool_config.decommit_age = atol(value);
+    }
+  if ((value = getenv("KMA_DECOMMIT_COUNT")) != NULL)
+    {
+      pool_config.decommit_count = atoi(value);
+    }
+  if ((value = getenv("KMA_DECOMMIT_SCAN")) != NULL)
+    {
+      pool_config.decommit_scan = atoi(value);
+    }
+  if ((value = getenv("KMA_DECOMMIT_LAZY")) != NULL)
+    {
+      pool_config.decommit_lazy = atoi(value);
+    }
+  if ((value = getenv("KMA_CACHE_PAGES")) != NULL)
+    {
+      pool_config.cache_pages = atoi(value);
+      if (pool_config.cache_pages < 0 || pool_config.cache_pages > KMA_CACHE_PAGES)
+	{
+	  pool_config.cache_pages = KMA_CACHE_PAGES;
+	}
+    }
+  if ((value = getenv("KMA_SHARED_PAGES")) != NULL)
+    {
+      pool_config.shared_pages = atoi(value);
+    }
+  if ((value = getenv("KMA_NUMA")) != NULL)
+    {
+      pool_config.numa = atoi(value);
+    }
+  if ((value = getenv("KMA_ADDRESS_ORDER")) != NULL)
+    {
+      pool_config.address_order = atoi(value);
+    }
+  if ((value = getenv("KMA_PREZERO")) != NULL)
+    {
+      pool_config.prezero = atoi(value);
+    }
+  if (pool_config.address_order)
+    {
+      pool_config.cache_pages = 0;
+      pool_config.shared_pages = 0;
+    }
+  
+  num_nodes = pool_config.numa ? countNodes() : 1;
+  for (i = 0; i < num_nodes; i++)
+    {
+      arenas[i].partial_chunks.prev = arenas[i].partial_chunks.next = &arenas[i].partial_chunks;
+      arenas[i].idle_chunks.prev = arenas[i].idle_chunks.next = &arenas[i].idle_chunks;
+      arenas[i].stats.page_size = PAGESIZE;
+    }
+  
+  coarse_now = msNow();
+  start_time = coarse_now;
+  
+  __atomic_store_n(&configured, TRUE, __ATOMIC_RELEASE);
+  
+  // the thread blocks on the pool lock until the caller lets go of it
+  if (pool_config.prezero > 0)
+    {
+      pthread_t thread;
+      
+      zeroed = malloc(pool_config.prezero * sizeof(void*));
+      if (zeroed == NULL || pthread_create(&thread, NULL, prezeroPages, NULL) != 0)
+	{
+	  error("error: unable to start the page zeroing thread", "");
+	}
+      pthread_detach(thread);
+    }
+}
+
+/* the number of memory nodes the system may have, 1 if it does not
+ * tell. nodes are listed as ranges, the highest one last. */
+int
+countNodes()
+{
+  char line[256];
+  int fd, i, n, last = 0;
+  
+  fd = open(NODEFILE, O_RDONLY);
+  if (fd < 0)
+    {
+      return 1;
+    }
+  n = read(fd, line, sizeof(line) - 1);
+  close(fd);
+  line[(n > 0) ? n : 0] = '\0';
+  
+  for (i = 0; i < n; i++)
+    {
+      if (isdigit(line[i]) && (i == 0 || !isdigit(line[i - 1])))
+	{
+	  last = atoi(line + i);
+	}
+    }
+  
+  return (last < MAXNODES) ? last + 1 : MAXNODES;
+}
+
+/* a cycle counter for latencies: the time stamp counter on x86,
+ * nanoseconds elsewhere */
+unsigned long
+cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#else
+  struct timespec ts;
+  
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+#endif
+}
+
+/* monotonic clock in milliseconds */
+long
+msNow()
+{
+  struct timespec ts;
   
-  *((void**)(pool + (MAXPAGES - 1) * PAGESIZE)) = NULL;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
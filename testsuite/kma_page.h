@@ -45,6 +45,7 @@
 #define __KPAGE_H__
 
 /************System include***********************************************/
+#include <stddef.h>
 
 /************Private include**********************************************/
 
@@ -64,7 +65,10 @@
 
 #define PAGESIZE 8192
 
-#define MAXPAGES 4096
+/* pages are carved from CHUNKPAGES-page chunks mapped on demand; the
+ * first page of every chunk holds the chunk bookkeeping */
+#define CHUNKPAGES 256
+#define CHUNKSIZE (CHUNKPAGES * PAGESIZE)
 
 /***********************************************************************
  *  Title: Base Address Macro
@@ -76,19 +80,47 @@
  ***********************************************************************/
 #define BASEADDR(x) ((void*)(((long) (x)) & ~(PAGESIZE-1)))
 
+/***********************************************************************
+ *  Title: Page Count Macro
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the number of pages needed to hold a number of bytes
+ *    Input: size in bytes
+ *    Output: the number of pages
+ ***********************************************************************/
+#define NUMPAGES(x) (((x) + PAGESIZE - 1) / PAGESIZE)
+
+/* tag is zero when the page is handed out and is never touched by the
+ * page allocator after that, backends may keep per-page metadata in it */
 typedef struct
 {
   int id;
   void* ptr;
-  int size;
+  size_t size;
+  int tag;
 } kma_page_t;
 
+/* get_page() latencies are counted in buckets of powers of two */
+#define LATENCYBUCKETS 32
+
 typedef struct
 {
   int num_requested;
   int num_freed;
   int num_in_use;
   int page_size;
+  int num_committed;    // pages mapped from the system
+  int num_resident;     // mapped pages currently backed by memory
+  int num_nodes;        // memory nodes with a page arena of their own
+  int max_in_use;       // most pages ever out of the pool at once
+  int max_committed;    // most pages ever mapped at once
+  int num_grows;        // chunks and spans mapped
+  int num_shrinks;      // chunks and spans unmapped
+  int num_decommitted;  // free pages given back to the system
+  long uptime;          // milliseconds since the pool was set up
+  double request_rate;  // pages requested per second of uptime
+  double free_rate;     // pages freed per second of uptime
+  long latency[LATENCYBUCKETS]; // get_page() calls that took 2^i to
+                                // 2^(i+1)-1 cycles, in KMA_LATENCY builds
 } kma_page_stat_t;
 
 /************Global Variables*********************************************/
@@ -98,7 +130,8 @@ typedef struct
 /***********************************************************************
  *  Title: Allocates a memory page
  * ---------------------------------------------------------------------
- *    Purpose: Allocates a memory page
+ *    Purpose: Allocates a memory page. the page allocator may be
+ *             called from any number of threads at once
  *    Input: none
  *    Output: the allocated memory page
  ***********************************************************************/
@@ -113,15 +146,108 @@ EXTERN kma_page_t* get_page();
  ***********************************************************************/
 EXTERN void free_page(kma_page_t*);
 
+/***********************************************************************
+ *  Title: Allocates contiguous memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates a run of n contiguous memory pages. the size
+ *             of the returned page structure covers the whole run
+ *    Input: the number of pages
+ *    Output: the allocated run of memory pages
+ ***********************************************************************/
+EXTERN kma_page_t* get_pages(int n);
+
+/***********************************************************************
+ *  Title: Allocates zero-filled memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates a run of n contiguous memory pages like
+ *             get_pages(), cleared to zero. pages fresh from the
+ *             system or given back to it are not cleared again
+ *    Input: the number of pages
+ *    Output: the allocated run of memory pages
+ ***********************************************************************/
+EXTERN kma_page_t* get_zeroed_pages(int n);
+
+/***********************************************************************
+ *  Title: Releases contiguous memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Releases a run of memory pages
+ *    Input: the pointer to the page structure returned by get_pages()
+ *    Output: none
+ ***********************************************************************/
+EXTERN void free_pages(kma_page_t*);
+
+/* pages handed to free_page_batch() per call by callers that gather a
+ * batch on the stack, like the backends when tearing down */
+#define PAGEBATCH 64
+
+/***********************************************************************
+ *  Title: Allocates a batch of memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Allocates n single pages in one operation, taking the
+ *             pool lock at most once. the pages need not be adjacent
+ *    Input: the number of pages and an array to hold them
+ *    Output: none, the array holds n page structures
+ ***********************************************************************/
+EXTERN void get_page_batch(int n, kma_page_t* pages[]);
+
+/***********************************************************************
+ *  Title: Releases a batch of memory pages
+ * ---------------------------------------------------------------------
+ *    Purpose: Releases n single pages in one operation, taking the
+ *             pool lock at most once
+ *    Input: the number of pages and the page structures returned by
+ *           get_page() or get_page_batch()
+ *    Output: none
+ ***********************************************************************/
+EXTERN void free_page_batch(int n, kma_page_t* pages[]);
+
+/***********************************************************************
+ *  Title: Finds the page of a pointer
+ * ---------------------------------------------------------------------
+ *    Purpose: Looks up the page structure of the page a pointer
+ *             points into, in constant time
+ *    Input: a pointer into a page returned by get_page(), or into
+ *           the first page of a run returned by get_pages()
+ *    Output: the memory page structure of that page or run
+ ***********************************************************************/
+EXTERN kma_page_t* page_of(void*);
+
 /***********************************************************************
  *  Title: Memory page statistics
  * ---------------------------------------------------------------------
  *    Purpose: Get the memory page statistics
  *    Input: none 
- *    Output: the memory page statistics in a static buffer
+ *    Output: the memory page statistics in a static buffer, see
+ *            page_snapshot()
  ***********************************************************************/
 EXTERN kma_page_stat_t* page_stats();
 
+/***********************************************************************
+ *  Title: Memory page statistics snapshot
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the memory page statistics without taking any lock,
+ *             safe to call from any thread while others allocate.
+ *             every counter is read atomically, but the snapshot as a
+ *             whole is not. pages out of the pool include the pages
+ *             cached by threads. take two snapshots for the rates of
+ *             an interval
+ *    Input: the buffer for the memory page statistics
+ *    Output: none
+ ***********************************************************************/
+EXTERN void page_snapshot(kma_page_stat_t*);
+
+/***********************************************************************
+ *  Title: Memory page statistics of a node
+ * ---------------------------------------------------------------------
+ *    Purpose: Get the memory page statistics of the pages of one
+ *             memory (NUMA) node. pages count as requested when the
+ *             page arena of the node hands them out, so the pages
+ *             cached by threads count as in use
+ *    Input: the node, below the num_nodes of page_stats()
+ *    Output: the memory page statistics of the node in a static buffer
+ ***********************************************************************/
+EXTERN kma_page_stat_t* page_node_stats(int node);
+
 /************External Declaration*****************************************/
 
 /**************Definition***************************************************/